@@ -1 +1,8 @@
 SRC+=__DIRNAME/src/fnet.c
+SRC+=__DIRNAME/src/fnet_trace.c
+SRC+=__DIRNAME/src/fnet_capture.c
+SRC+=__DIRNAME/src/fnet_shm.c
+SRC+=__DIRNAME/src/fnet_co.c
+SRC+=__DIRNAME/src/fnet_http.c
+SRC+=__DIRNAME/src/fnet_dns.c
+SRC+=__DIRNAME/src/fnet_handover.c
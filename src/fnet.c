@@ -1,3 +1,7 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // sched_setaffinity
+#endif
+
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -14,15 +18,29 @@
 #else
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <linux/filter.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
 #include "finwo/poll.h"
 #include "tidwall/buf.h"
 
 #include "fnet.h"
+#include "fnet_capture.h"
+#include "fnet_dns.h"
+#include "fnet_handover.h"
+#include "fnet_shm.h"
+#include "fnet_trace.h"
 
 #if defined(_WIN32) || defined(_WIN64)
 #define FNET_SOCKET unsigned int
@@ -32,18 +50,161 @@ bool w32_initialized = false;
 #define FNET_SOCKET int
 #endif
 
+#if defined(__linux__) && !defined(SO_BUSY_POLL)
+#define SO_BUSY_POLL 46
+#endif
+#if defined(__linux__) && !defined(SO_PREFER_BUSY_POLL)
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#if defined(__linux__) && !defined(SO_INCOMING_CPU)
+#define SO_INCOMING_CPU 49
+#endif
+#if defined(__linux__) && !defined(SO_ATTACH_REUSEPORT_CBPF)
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#define FNET_MPOL_PREFERRED 1
+#if (defined(_WIN32) || defined(_WIN64)) && !defined(SHUT_WR)
+#define SHUT_WR SD_SEND
+#endif
+
+// Not every fpoll backend reports these, without them the next recv finds out
+#ifdef FPOLL_RDHUP
+#define FNET_POLL_RDHUP FPOLL_RDHUP
+#else
+#define FNET_POLL_RDHUP 0
+#endif
+#ifdef FPOLL_ERR
+#define FNET_POLL_ERR FPOLL_ERR
+#else
+#define FNET_POLL_ERR 0
+#endif
+#define FNET_POLL_READ (FPOLL_IN | FNET_POLL_RDHUP)
+
+// Bounds for the adaptive receive size of a connection
+#ifndef FNET_RECV_MIN
+#define FNET_RECV_MIN 1024
+#endif
+#ifndef FNET_RECV_MAX
+#define FNET_RECV_MAX 262144
+#endif
+
+// Events taken from the poll per pass
+#ifndef FNET_POLL_EVENTS
+#define FNET_POLL_EVENTS 64
+#endif
+
+// Ms a listener stays paused after accept ran out of descriptors or memory
+#ifndef FNET_ACCEPT_BACKOFF
+#define FNET_ACCEPT_BACKOFF 100
+#endif
+
+// Ticks a closed connection gets to send what was still queued
+#ifndef FNET_LINGER
+#define FNET_LINGER 5
+#endif
+
+// Ticks an accepted shared memory peer gets to hand over its rings
+#ifndef FNET_SHM_GREET
+#define FNET_SHM_GREET 2
+#endif
+
 struct fnet_internal_t {
   struct fnet_t ext; // KEEP AT TOP, allows casting between fnet_internal_t* and fnet_t*
   void          *prev;
   void          *next;
+  uint64_t      id;
   FNET_SOCKET   *fds;
   int           nfds;
   FNET_FLAG     flags;
+
+  // Admission control
+  struct fnet_internal_t *parent;  // Listener that accepted this connection
+  int                    nconns;   // Live connections accepted by this listener
+  int                    maxconn;
+  int                    rate;
+  int                    burst;
+  int64_t                tokens;   // In milli-tokens, 1000 allows 1 accept
+  int64_t                refilled;
+  int64_t                backoff;  // Accept failed for lack of resources, not before this time
+  bool                   paused;
+  struct buf             *shedResponse;
+
+  // Receiving
+  struct buf             rbuf;
+  size_t                 rsize;    // Bytes requested per recv, adapts to traffic
+  int                    rcvlowat;
+
+  // Sending
+  struct buf             wbuf;     // Not yet accepted by the kernel
+  bool                   wantout;  // Polling for FPOLL_OUT
+  bool                   shutwr;   // fnet_end called, shut down sending once wbuf drained
+  int                    linger;   // Ticks left to send wbuf for a closed connection or to greet, then dropped
+
+  struct fnet_resolve_t  *resolving; // Lookup in flight for fnet_listen or fnet_connect
+
+  // FNET_PROTO_SHM, fds are the doorbell and the rendezvous socket
+  struct fnet_shm_t      *shm;
+  size_t                 shmsize;
+  bool                   greeting; // Accepted, waiting for the peer's rings on fds[0]
+
+  // Restarts
+  struct fnet_handover_t *handover; // Set on the socket the next process connects to
+  bool                   handed;    // Sent to the next process, closed here once it confirmed
+
+  // Memory
+  size_t                 rmem;     // Receive buffer bytes in memstats
+  size_t                 wmem;     // Send buffer bytes in memstats
+  int64_t                charged;  // Reported through fnet_charge
+  int                    idle;     // Ticks without reads or writes, or since closing
+  bool                   rpaused;  // Not polling for FPOLL_IN until the send queue drains
+  bool                   held;     // Not read from until the application calls fnet_readable
+  bool                   owned;    // Created by accepting, freed by us once closed
+
+  // Scheduling
+  FNET_PRIORITY          priority;
+  FPOLL_STATUS           ready;    // Events not handled yet
+  bool                   queued;
+  struct fnet_internal_t *runnext;
+};
+
+// Sockets received through fnet_takeover, until fnet_listen claims them
+struct fnet_inherited_t {
+  struct fnet_handover_rec rec;
+  FNET_SOCKET              fd;
+  struct buf               wbuf;     // Connections, not sent to the peer yet
+  struct buf               rbuf;     // Connections, received but not processed yet
+  struct fnet_internal_t   *claimed; // Connections, the listener that took over theirs
+};
+
+struct fnet_timer_t {
+  int64_t  at;
+  size_t   index; // Position in the heap
+  FNET_CALLBACK(cb);
+  void     *udata;
 };
 
 struct fnet_internal_t *connections = NULL;
 struct fpoll           *fpfd        = NULL;
 int                    runners      = 0;
+int                    accepted     = 0; // Live accepted connections, all listeners
+int                    maxaccepted  = 0;
+int                    paused       = 0; // Listeners not polling their fds
+uint64_t               lastid       = 0;
+int                    loopcpu      = -1; // Set by fnet_pin
+struct fnet_busypoll_t busypoll     = {};
+struct fnet_stats_t    stats        = {};
+struct fnet_timer_t    **timers     = NULL; // Min-heap on timer->at
+size_t                 ntimers      = 0;
+size_t                 captimers    = 0;
+struct fnet_memory_t   memory       = {};
+struct fnet_memstats_t memstats     = {};
+bool                   memtight     = false; // Over the soft limit, cleared a bit below it
+struct fnet_fairness_t fairness     = {};
+struct fnet_internal_t *runq[3]     = {};    // Connections with work left, by class, highest first
+struct fnet_internal_t *runtail[3]  = {};
+size_t                 nrun[3]      = {};
+struct fnet_inherited_t *inherited  = NULL;
+size_t                 ninherited   = 0;
 
 FNET_RETURNCODE setkeepalive(FNET_SOCKET fd) {
     if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &(int){1}, sizeof(int))) {
@@ -92,6 +253,25 @@ FNET_RETURNCODE setnonblock(FNET_SOCKET fd) {
 #endif
 }
 
+FNET_RETURNCODE setblock(FNET_SOCKET fd) {
+  if (fd < 0) return FNET_RETURNCODE_ERROR;
+#if defined(_WIN32) || defined(_WIN64)
+  unsigned long mode = 0;
+  if (ioctlsocket(fd, FIONBIO, &mode) == 0) {
+    return FNET_RETURNCODE_OK;
+  } else {
+    return FNET_RETURNCODE_ERROR;
+  }
+#else
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) return flags;
+  if(fcntl(fd, F_SETFL, flags & ~O_NONBLOCK)) {
+    return FNET_RETURNCODE_ERROR;
+  }
+  return FNET_RETURNCODE_OK;
+#endif
+}
+
 int64_t _fnet_now() {
 #if defined(_WIN32) || defined(_WIN64)
   struct _timeb timebuffer;
@@ -104,6 +284,70 @@ int64_t _fnet_now() {
 #endif
 }
 
+// Monotonic, only used for measuring
+int64_t _fnet_now_us() {
+#if defined(_WIN32) || defined(_WIN64)
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (int64_t)((count.QuadPart * 1000000.0) / freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * ((int64_t)1000000)) + (ts.tv_nsec / 1000);
+#endif
+}
+
+// Options applied to every connected socket, failures are reported by fnet_busypoll
+FNET_RETURNCODE _fnet_sockopts(FNET_SOCKET fd) {
+#if defined(__linux__)
+  if (busypoll.busyPoll) {
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &(busypoll.busyPoll), sizeof(int))) {
+      return FNET_RETURNCODE_ERRNO;
+    }
+  }
+  if (busypoll.preferBusyPoll) {
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &(int){1}, sizeof(int))) {
+      return FNET_RETURNCODE_ERRNO;
+    }
+  }
+#endif
+  return FNET_RETURNCODE_OK;
+}
+
+// Steers connections to the reuseport group member matching the receiving cpu
+// The n-th listener in the group handles cpu n, the kernel hashes cpus beyond the group size
+FNET_RETURNCODE _fnet_steer(FNET_SOCKET fd) {
+#if defined(__linux__)
+  struct sock_filter code[] = {
+    { BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+    { BPF_RET | BPF_A          , 0, 0, 0                       },
+  };
+  struct sock_fprog prog = {
+    .len    = sizeof(code) / sizeof(code[0]),
+    .filter = code,
+  };
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog))) {
+    return FNET_RETURNCODE_ERRNO;
+  }
+  return FNET_RETURNCODE_OK;
+#else
+  return FNET_RETURNCODE_NOT_IMPLEMENTED;
+#endif
+}
+
+// Brings the memory counters in line with the connection's buffers
+void _fnet_account(struct fnet_internal_t *conn) {
+  if (conn) {
+    memstats.recvBuffers += conn->rbuf.cap - conn->rmem;
+    memstats.sendBuffers += conn->wbuf.cap - conn->wmem;
+    conn->rmem = conn->rbuf.cap;
+    conn->wmem = conn->wbuf.cap;
+  }
+  memstats.total = memstats.connections + memstats.recvBuffers + memstats.sendBuffers + memstats.charged;
+  if (memstats.total > memstats.peak) memstats.peak = memstats.total;
+}
+
 // CAUTION: assumes options have been vetted
 struct fnet_internal_t * _fnet_init(const struct fnet_options_t *options) {
   if (!fpfd) fpfd = fpoll_create();
@@ -119,10 +363,54 @@ struct fnet_internal_t * _fnet_init(const struct fnet_options_t *options) {
   conn->ext.onData    = options->onData;
   conn->ext.onTick    = options->onTick;
   conn->ext.onClose   = options->onClose;
+  conn->id            = ++lastid;
   conn->nfds          = 0;
   conn->fds           = NULL;
+  conn->ext.onShed    = options->onShed;
+  conn->ext.cpu       = -1;
+  conn->ext.error     = 0;
+  conn->parent        = NULL;
+  conn->nconns        = 0;
+  conn->maxconn       = options->maxConnections;
+  conn->rate          = options->acceptRate;
+  conn->burst         = options->acceptBurst ? options->acceptBurst : options->acceptRate;
+  conn->tokens        = conn->burst * ((int64_t)1000);
+  conn->refilled      = _fnet_now();
+  conn->backoff       = 0;
+  conn->paused        = false;
+  conn->shedResponse  = options->shedResponse;
+  conn->rbuf          = (struct buf){};
+  conn->rsize         = BUFSIZ;
+  conn->rcvlowat      = options->rcvLowat;
+  conn->wbuf          = (struct buf){};
+  conn->wantout       = false;
+  conn->ext.onDrain   = options->onDrain;
+  conn->ext.onEnd     = options->onEnd;
+  conn->shutwr        = false;
+  conn->linger        = 0;
+  conn->greeting      = false;
+  conn->resolving     = NULL;
+  conn->shm           = NULL;
+  conn->shmsize       = options->shmSize;
+  conn->handover      = NULL;
+  conn->handed        = false;
+  conn->rmem          = 0;
+  conn->wmem          = 0;
+  conn->charged       = 0;
+  conn->idle          = 0;
+  conn->rpaused       = false;
+  conn->held          = false;
+  conn->owned         = false;
+  conn->priority      = options->priority;
+  conn->ready         = 0;
+  conn->queued        = false;
+  conn->runnext       = NULL;
+
+  memstats.connections += sizeof(struct fnet_internal_t);
+  _fnet_account(conn);
 
   // Aanndd add to the connection tracking list
+  conn->prev = NULL;
   conn->next = connections;
   if (connections) connections->prev = conn;
   connections = conn;
@@ -131,167 +419,1311 @@ struct fnet_internal_t * _fnet_init(const struct fnet_options_t *options) {
   return conn;
 }
 
+void _fnet_emit(struct fnet_internal_t *conn, FNET_CALLBACK(cb), FNET_EVENT type) {
+  if (!cb) return;
+  FNET_TRACE(CB_ENTER, conn, type);
+  cb(&((struct fnet_ev){
+    .connection = (struct fnet_t *)conn,
+    .type       = type,
+    .buffer     = NULL,
+    .udata      = conn->ext.udata,
+  }));
+  FNET_TRACE(CB_EXIT, conn, type);
+}
 
-struct fnet_t * fnet_listen(const char *address, uint16_t port, const struct fnet_options_t *options) {
-  struct fnet_internal_t *conn;
+// Hands what's in rbuf to the application
+void _fnet_received(struct fnet_internal_t *conn) {
+  FNET_CAPTURE(RECV, conn, conn->rbuf.data, conn->rbuf.len);
+  if (!conn->ext.onData) return;
+  FNET_TRACE(CB_ENTER, conn, FNET_EVENT_DATA);
+  conn->ext.onData(&((struct fnet_ev){
+    .connection = (struct fnet_t *)conn,
+    .type       = FNET_EVENT_DATA,
+    .buffer     = &(conn->rbuf),
+    .udata      = conn->ext.udata,
+  }));
+  FNET_TRACE(CB_EXIT, conn, FNET_EVENT_DATA);
+}
 
-#if defined(_WIN32) || defined(_WIN64)
-  if (!w32_initialized) {
-    WSADATA wsaData;
-    int err = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (err) {
-      fprintf(stderr, "fnet_listen: WSAStartup\n");
-      return NULL;
+// Run queue index, highest class first
+int _fnet_class(FNET_PRIORITY priority) {
+  if (priority == FNET_PRIORITY_HIGH) return 0;
+  if (priority == FNET_PRIORITY_BULK) return 2;
+  return 1;
+}
+
+// Queues the connection for a turn in the next pass, ev is added to what's waiting
+void _fnet_enqueue(struct fnet_internal_t *conn, FPOLL_STATUS ev) {
+  int c = _fnet_class(conn->priority);
+  conn->ready |= ev;
+  if (conn->queued) return;
+  conn->queued  = true;
+  conn->runnext = NULL;
+  if (runtail[c]) {
+    runtail[c]->runnext = conn;
+  } else {
+    runq[c] = conn;
+  }
+  runtail[c] = conn;
+  nrun[c]++;
+}
+
+void _fnet_dequeue(struct fnet_internal_t *conn) {
+  struct fnet_internal_t **link;
+  int c = _fnet_class(conn->priority);
+  if (!conn->queued) return;
+  for ( link = &(runq[c]) ; *link ; link = &((*link)->runnext) ) {
+    if (*link != conn) continue;
+    *link = conn->runnext;
+    if (runtail[c] == conn) runtail[c] = NULL;
+    break;
+  }
+  if (!runq[c]) {
+    runtail[c] = NULL;
+  } else if (!runtail[c]) {
+    for ( runtail[c] = runq[c] ; runtail[c]->runnext ; runtail[c] = runtail[c]->runnext );
+  }
+  conn->queued = false;
+  conn->ready  = 0;
+  nrun[c]--;
+}
+
+// Stop polling the listening fds, pending connections stay in the backlog
+void _fnet_pause(struct fnet_internal_t *conn) {
+  int i;
+  if (conn->paused) return;
+  for ( i = 0 ; i < conn->nfds ; i++ ) {
+    if (fpfd) fpoll_del(fpfd, ~0, conn->fds[i]);
+  }
+  conn->paused = true;
+  paused++;
+  FNET_TRACE(SHED, conn, 0);
+  _fnet_emit(conn, conn->ext.onShed, FNET_EVENT_SHED);
+}
+
+void _fnet_resume(struct fnet_internal_t *conn) {
+  int i;
+  if (!conn->paused) return;
+  for ( i = 0 ; i < conn->nfds ; i++ ) {
+    if (fpfd) fpoll_add(fpfd, FPOLL_IN | FPOLL_HUP, conn->fds[i], conn);
+  }
+  conn->paused = false;
+  paused--;
+  _fnet_emit(conn, conn->ext.onShed, FNET_EVENT_RESUME);
+}
+
+void _fnet_refill(struct fnet_internal_t *conn) {
+  int64_t now = _fnet_now();
+  if (!conn->rate) return;
+  conn->tokens  += (now - conn->refilled) * conn->rate;
+  conn->refilled = now;
+  if (conn->tokens > (conn->burst * ((int64_t)1000))) {
+    conn->tokens = conn->burst * ((int64_t)1000);
+  }
+}
+
+// Returns whether the listener may accept another connection right now
+bool _fnet_admit(struct fnet_internal_t *conn) {
+  if (memtight) return false;
+  if (conn->backoff) {
+    if (_fnet_now() < conn->backoff) return false;
+    conn->backoff = 0;
+  }
+  if (maxaccepted && (accepted >= maxaccepted)) return false;
+  if (conn->maxconn && (conn->nconns >= conn->maxconn)) return false;
+  if (!conn->rate) return true;
+  _fnet_refill(conn);
+  return conn->tokens >= 1000;
+}
+
+// Resumes listeners that may accept again
+// Returns the amount of ms until the next token becomes available, or -1
+int64_t _fnet_admission() {
+  struct fnet_internal_t *conn;
+  int64_t wait = -1;
+  int64_t w;
+  if (!paused) return -1;
+  for ( conn = connections ; conn ; conn = conn->next ) {
+    if (!conn->paused) continue;
+    if (_fnet_admit(conn)) {
+      _fnet_resume(conn);
+      continue;
     }
-    w32_initialized = true;
+    if (conn->rate && (conn->tokens < 1000)) {
+      w = ((1000 - conn->tokens) + conn->rate - 1) / conn->rate;
+      if ((wait < 0) || (w < wait)) wait = w;
+    }
+    if (conn->backoff) {
+      w = conn->backoff - _fnet_now();
+      if (w < 1) w = 1;
+      if ((wait < 0) || (w < wait)) wait = w;
+    }
+  }
+  return wait;
+}
+
+// Accepts and drops a pending connection without tracking it
+void _fnet_shed(struct fnet_internal_t *conn, FNET_SOCKET fd) {
+  if (conn->shedResponse) {
+    send(fd, conn->shedResponse->data, conn->shedResponse->len, 0);
+  } else {
+    // RST instead of FIN, no TIME_WAIT left behind
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &((struct linger){ .l_onoff = 1, .l_linger = 0 }), sizeof(struct linger));
   }
+#if defined(_WIN32) || defined(_WIN64)
+  closesocket(fd);
+#else
+  close(fd);
 #endif
+  FNET_TRACE(SHED, conn, 1);
+  _fnet_emit(conn, conn->ext.onShed, FNET_EVENT_SHED);
+}
 
-  // Checking arguments are given
-  if (!address) {
-    fprintf(stderr, "fnet_listen: address argument is required\n");
-    return NULL;
+FNET_RETURNCODE fnet_max_connections(int max) {
+  if (max < 0) return FNET_RETURNCODE_UNPROCESSABLE;
+  maxaccepted = max;
+  return FNET_RETURNCODE_OK;
+}
+
+void _fnet_timer_swap(size_t a, size_t b) {
+  struct fnet_timer_t *tmp = timers[a];
+  timers[a] = timers[b];
+  timers[b] = tmp;
+  timers[a]->index = a;
+  timers[b]->index = b;
+}
+
+void _fnet_timer_up(size_t i) {
+  while(i && (timers[(i - 1) / 2]->at > timers[i]->at)) {
+    _fnet_timer_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
   }
-  if (!port) {
-    fprintf(stderr, "fnet_listen: port argument is required\n");
-    return NULL;
+}
+
+void _fnet_timer_down(size_t i) {
+  size_t child;
+  for(;;) {
+    child = (i * 2) + 1;
+    if (child >= ntimers) return;
+    if (((child + 1) < ntimers) && (timers[child + 1]->at < timers[child]->at)) child++;
+    if (timers[i]->at <= timers[child]->at) return;
+    _fnet_timer_swap(i, child);
+    i = child;
   }
-  if (!options) {
-    fprintf(stderr, "fnet_listen: options argument is required\n");
+}
+
+struct fnet_timer_t * fnet_timer(int64_t ms, FNET_CALLBACK(cb), void *udata) {
+  struct fnet_timer_t *timer;
+  struct fnet_timer_t **list;
+
+  if (!cb) {
+    fprintf(stderr, "fnet_timer: cb argument is required\n");
     return NULL;
   }
 
-  // Check if we support the protocol
-  switch(options->proto) {
-    case FNET_PROTO_TCP:
-      // Intentionally empty
-      // TODO: tcp-specific arg validation
-      break;
-    default:
-      fprintf(stderr, "fnet_listen: unknown protocol\n");
-      return NULL;
+  if (ntimers == captimers) {
+    list = realloc(timers, (captimers ? captimers * 2 : 16) * sizeof(struct fnet_timer_t *));
+    if (!list) return NULL;
+    timers    = list;
+    captimers = captimers ? captimers * 2 : 16;
   }
 
-  // 1-to-1 copy, don't touch the options
-  conn = _fnet_init(options);
+  timer = malloc(sizeof(struct fnet_timer_t));
+  if (!timer) return NULL;
 
-  /* struct sockaddr_in servaddr; */
-  struct addrinfo hints = {}, *addrs;
-  char port_str[6] = {};
+  // Timers are run from the poll loop, which may not have a socket yet
+  if (!fpfd) fpfd = fpoll_create();
+  timer->at    = _fnet_now() + (ms < 0 ? 0 : ms);
+  timer->cb    = cb;
+  timer->udata = udata;
+  timer->index = ntimers;
+
+  timers[ntimers++] = timer;
+  _fnet_timer_up(timer->index);
+  return timer;
+}
 
-  hints.ai_family   = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
+FNET_RETURNCODE fnet_timer_cancel(struct fnet_timer_t *timer) {
+  size_t i;
+  if (!timer) {
+    fprintf(stderr, "fnet_timer_cancel: timer argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  i = timer->index;
+  ntimers--;
+  if (i != ntimers) {
+    _fnet_timer_swap(i, ntimers);
+    _fnet_timer_up(i);
+    _fnet_timer_down(i);
+  }
+  free(timer);
+  return FNET_RETURNCODE_OK;
+}
 
-  // Get address info
-  snprintf(port_str, sizeof(port_str), "%d", port);
-  int ai_err = getaddrinfo(address, port_str, &hints, &addrs);
-  if (ai_err != 0) {
-    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ai_err));
-    fnet_free((struct fnet_t *)conn);
-    return NULL;
+// Fires due timers
+// Returns the amount of ms until the next timer is due, or -1
+int64_t _fnet_timers() {
+  struct fnet_timer_t *timer;
+  int64_t now = _fnet_now();
+  FNET_CALLBACK(cb);
+  void *udata;
+
+  while(ntimers && (timers[0]->at <= now)) {
+    timer = timers[0];
+    cb    = timer->cb;
+    udata = timer->udata;
+    fnet_timer_cancel(timer);
+    cb(&((struct fnet_ev){
+      .connection = NULL,
+      .type       = FNET_EVENT_TIMER,
+      .buffer     = NULL,
+      .udata      = udata,
+    }));
   }
 
-  // Count the addresses to listen on
-  // For example, "localhost" turned to "127.0.0.1" and "::1"
-  int naddrs = 0;
-  struct addrinfo *addrinfo = addrs;
-  while(addrinfo) {
-    naddrs++;
-    addrinfo = addrinfo->ai_next;
+  if (!ntimers) return -1;
+  return timers[0]->at - now;
+}
+
+// (Re-)register the connection's fds for what it can handle right now
+void _fnet_poll(struct fnet_internal_t *conn) {
+  int i;
+  if (!fpfd) return;
+  for ( i = 0 ; i < conn->nfds ; i++ ) {
+    // A shared memory doorbell also rings for room to write, it's always polled
+    fpoll_del(fpfd, ~0, conn->fds[i]);
+    fpoll_add(fpfd, (((conn->rpaused || (conn->ext.status & FNET_STATUS_END)) && !conn->shm) ? 0 : FNET_POLL_READ) | FPOLL_HUP | ((conn->wantout && !conn->shm) ? FPOLL_OUT : 0), conn->fds[i], conn);
   }
+}
 
-  conn->fds = malloc(naddrs * sizeof(FNET_SOCKET));
-  if (!conn->fds) {
-    fprintf(stderr, "%s\n", strerror(ENOMEM));
-    fnet_free((struct fnet_t *)conn);
-    freeaddrinfo(addrs);
-    return NULL;
+// Only wait for FPOLL_OUT when there's something to send
+void _fnet_arm(struct fnet_internal_t *conn, bool out) {
+  if (conn->wantout == out) return;
+  conn->wantout = out;
+  _fnet_poll(conn);
+}
+
+// Stop reading from a peer, the kernel's buffers fill up and push back on it
+void _fnet_readable(struct fnet_internal_t *conn, bool readable) {
+  if (conn->rpaused != readable) return;
+  conn->rpaused = !readable;
+  if (!readable) memstats.readPauses++;
+  _fnet_poll(conn);
+}
+
+// Our side won't send anymore, the peer reads EOF
+void _fnet_shutwr(struct fnet_internal_t *conn) {
+  if (conn->shm) {
+    _fnet_shm_end(conn->shm);
+    return;
   }
+  shutdown(conn->fds[0], SHUT_WR);
+}
 
-  addrinfo = addrs;
-  for (; addrinfo ; addrinfo = addrinfo->ai_next ) {
+// Hands as much of the pending writes to the kernel as it accepts
+FNET_RETURNCODE _fnet_flush(struct fnet_internal_t *conn) {
+  size_t  n = 0;
+  ssize_t r;
 
-    FNET_SOCKET fd = socket(addrinfo->ai_family, addrinfo->ai_socktype, addrinfo->ai_protocol);
-    if (fd < 0) {
-      fprintf(stderr, "socket\n");
-      fnet_free((struct fnet_t *)conn);
-      freeaddrinfo(addrs);
-      return NULL;
-    }
+  // Shared memory peers take what fits in their ring, and ring once there's room for more
+  if (conn->shm) n = _fnet_shm_write(conn->shm, conn->wbuf.data, conn->wbuf.len);
+  if (conn->shm && conn->shm->broken) return FNET_RETURNCODE_ERRNO;
 
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
-      fprintf(stderr, "setsockopt(SO_REUSEADDR)\n");
-      fnet_free((struct fnet_t *)conn);
-      freeaddrinfo(addrs);
-      return NULL;
+  while(!conn->shm && (n < conn->wbuf.len)) {
+    r = send(conn->fds[0], &(conn->wbuf.data[n]), conn->wbuf.len - n, 0);
+    if (r < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        FNET_TRACE(SEND_EAGAIN, conn, 0);
+        break;
+      }
+      return FNET_RETURNCODE_ERRNO;
+    }
+    if ((size_t)r < (conn->wbuf.len - n)) {
+      FNET_TRACE(SEND_PARTIAL, conn, r);
+    } else {
+      FNET_TRACE(SEND, conn, r);
     }
+    n += r;
+  }
 
-    if (setnonblock(fd) < 0) {
-      fprintf(stderr, "setnonblock\n");
-      fnet_free((struct fnet_t *)conn);
-      freeaddrinfo(addrs);
-      return NULL;
+  if (n) {
+    memmove(conn->wbuf.data, conn->wbuf.data + n, conn->wbuf.len - n);
+    conn->wbuf.len -= n;
+    conn->idle = 0;
+  }
+
+  if (conn->wbuf.len) {
+    _fnet_arm(conn, true);
+    return FNET_RETURNCODE_OK;
+  }
+
+  // Fully drained, don't keep a send buffer around
+  free(conn->wbuf.data);
+  conn->wbuf = (struct buf){};
+  _fnet_account(conn);
+  if (conn->linger) {
+    fnet_close((struct fnet_t *)conn);
+    return FNET_RETURNCODE_OK;
+  }
+  if (conn->shutwr) {
+    _fnet_shutwr(conn);
+    if (conn->ext.status & FNET_STATUS_END) {
+      fnet_close((struct fnet_t *)conn);
+      return FNET_RETURNCODE_OK;
     }
+  }
+  if (conn->rpaused && !conn->held) _fnet_readable(conn, true);
+  if (conn->wantout) {
+    _fnet_arm(conn, false);
+    _fnet_emit(conn, conn->ext.onDrain, FNET_EVENT_DRAIN);
+  }
+  return FNET_RETURNCODE_OK;
+}
 
-    if (bind(fd, addrinfo->ai_addr, addrinfo->ai_addrlen) < 0) {
-      fprintf(stderr, "bind: %s\n", strerror(errno));
-      fnet_free((struct fnet_t *)conn);
-      freeaddrinfo(addrs);
-      return NULL;
+// Frees the receive buffer and trims the send buffer, only call outside of onData
+void _fnet_release(struct fnet_internal_t *conn) {
+  size_t before = conn->rbuf.cap + conn->wbuf.cap;
+  char   *data;
+
+  if (conn->rbuf.data) free(conn->rbuf.data);
+  conn->rbuf = (struct buf){};
+
+  if (conn->wbuf.len && (conn->wbuf.cap > conn->wbuf.len)) {
+    data = realloc(conn->wbuf.data, conn->wbuf.len);
+    if (data) {
+      conn->wbuf.data = data;
+      conn->wbuf.cap  = conn->wbuf.len;
     }
+  }
 
-    if (listen(fd, SOMAXCONN) < 0) {
-      fprintf(stderr, "listen: %s\n", strerror(errno));
-      fnet_free((struct fnet_t *)conn);
-      freeaddrinfo(addrs);
-      return NULL;
+  memstats.released += before - (conn->rbuf.cap + conn->wbuf.cap);
+  _fnet_account(conn);
+}
+
+// Called every tick, releases the buffers of idle connections and frees closed accepted ones
+void _fnet_sweep() {
+  struct fnet_internal_t *conn, *next;
+  int64_t ticks = (memory.idleRelease + 999) / 1000;
+
+  for ( conn = connections ; conn ; conn = next ) {
+    next = conn->next;
+    if (conn->idle < 1000000) conn->idle++;
+
+    // Closed for at least a full tick, nobody should be holding on to it anymore
+    if (conn->owned && (conn->ext.status & FNET_STATUS_CLOSED)) {
+      if (conn->idle >= 2) {
+        memstats.reaped++;
+        fnet_free((struct fnet_t *)conn);
+      }
+      continue;
     }
 
-    conn->fds[conn->nfds] = fd;
-    conn->nfds++;
+    // Out of time to send what was queued when closing, or to greet us
+    if (conn->linger && !--conn->linger) {
+      if (conn->wbuf.data) free(conn->wbuf.data);
+      conn->wbuf = (struct buf){};
+      fnet_close((struct fnet_t *)conn);
+      continue;
+    }
 
-    if (fpfd) {
-      fpoll_add(fpfd, FPOLL_IN | FPOLL_HUP, fd, conn);
+    if (ticks && (conn->idle >= ticks) && (conn->rbuf.data || (conn->wbuf.cap > conn->wbuf.len))) {
+      _fnet_release(conn);
     }
   }
+}
 
-  if (conn->ext.onListen) {
-    conn->ext.onListen(&((struct fnet_ev){
-      .connection = (struct fnet_t *)conn,
-      .type       = FNET_EVENT_LISTEN,
-      .buffer     = NULL,
-      .udata      = conn->ext.udata,
-    }));
+// Sheds an accepted connection, whatever it still had to send is lost
+void _fnet_drop(struct fnet_internal_t *conn) {
+  memstats.shed++;
+  FNET_TRACE(SHED, conn, 2);
+  _fnet_emit(conn, conn->ext.onShed, FNET_EVENT_SHED);
+
+  if (conn->wbuf.data) free(conn->wbuf.data);
+  conn->wbuf = (struct buf){};
+  _fnet_account(conn);
+
+  // RST instead of FIN, like shedding from the backlog
+  if (conn->nfds) {
+    setsockopt(conn->fds[0], SOL_SOCKET, SO_LINGER, &((struct linger){ .l_onoff = 1, .l_linger = 0 }), sizeof(struct linger));
   }
 
-  freeaddrinfo(addrs);
-  conn->ext.status = FNET_STATUS_LISTENING;
-  return (struct fnet_t *)conn;
+  // The application hears about it through onClose, the connection is gone once that returns
+  conn->ext.error = ENOBUFS;
+  fnet_close((struct fnet_t *)conn);
+  fnet_free((struct fnet_t *)conn);
 }
 
-struct fnet_t * fnet_connect(const char *address, uint16_t port, const struct fnet_options_t *options) {
-  struct fnet_internal_t *conn;
+// Applies the memory limits, called from the loop between events
+void _fnet_pressure() {
+  struct fnet_internal_t *conn, *biggest;
+
+  // Shed whoever's using the most until we're back under the hard limit
+  while(memory.hardLimit && (memstats.total > memory.hardLimit)) {
+    biggest = NULL;
+    for ( conn = connections ; conn ; conn = conn->next ) {
+      if (!conn->owned || (conn->ext.status & FNET_STATUS_CLOSED)) continue;
+      if (!biggest || (fnet_footprint((struct fnet_t *)conn) > fnet_footprint((struct fnet_t *)biggest))) {
+        biggest = conn;
+      }
+    }
+    if (!biggest) break;
+    _fnet_drop(biggest);
+  }
 
-  // Checking arguments are given
-  if (!address) {
-    fprintf(stderr, "fnet_connect: address argument is required\n");
-    return NULL;
+  if (memtight) {
+    if (!memory.softLimit || (memstats.total < (memory.softLimit - (memory.softLimit >> 3)))) {
+      memtight = false;
+    }
+    return;
   }
-  if (!port) {
-    fprintf(stderr, "fnet_connect: port argument is required\n");
+
+  if (!memory.softLimit || (memstats.total <= memory.softLimit)) return;
+  memtight = true;
+
+  // Receive buffers are only needed during onData, and peers we can't send to shouldn't send more
+  for ( conn = connections ; conn ; conn = conn->next ) {
+    if (!(conn->ext.status & FNET_STATUS_CONNECTED)) continue;
+    _fnet_release(conn);
+    if (conn->wbuf.len) _fnet_readable(conn, false);
+  }
+}
+
+FNET_RETURNCODE fnet_memory(const struct fnet_memory_t *options) {
+  if (!options) {
+    fprintf(stderr, "fnet_memory: options argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  if ((options->idleRelease < 0) || (options->hardLimit && (options->softLimit > options->hardLimit))) {
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+  memory = *options;
+  return FNET_RETURNCODE_OK;
+}
+
+FNET_RETURNCODE fnet_memstats(struct fnet_memstats_t *out) {
+  if (!out) {
+    fprintf(stderr, "fnet_memstats: out argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  *out = memstats;
+  return FNET_RETURNCODE_OK;
+}
+
+// Bytes held by the connection, including what was charged to it
+size_t fnet_footprint(const struct fnet_t *connection) {
+  const struct fnet_internal_t *conn = (const struct fnet_internal_t *)connection;
+  if (!conn) return 0;
+  return sizeof(struct fnet_internal_t) + conn->rbuf.cap + conn->wbuf.cap + conn->charged;
+}
+
+// Accounts memory a handler keeps for the connection, or for the loop when connection is NULL
+// Charge a negative amount when releasing it, all of it is dropped when the connection is freed
+FNET_RETURNCODE fnet_charge(const struct fnet_t *connection, int64_t bytes) {
+  struct fnet_internal_t *conn = (struct fnet_internal_t *)connection;
+  if (conn) conn->charged += bytes;
+  memstats.charged += bytes;
+  _fnet_account(NULL);
+  return FNET_RETURNCODE_OK;
+}
+
+size_t fnet_pending(const struct fnet_t *connection) {
+  struct fnet_internal_t *conn = (struct fnet_internal_t *)connection;
+  if (!conn) return 0;
+  return conn->wbuf.len;
+}
+
+FNET_RETURNCODE fnet_busypoll(const struct fnet_busypoll_t *options) {
+  if (!options) {
+    fprintf(stderr, "fnet_busypoll: options argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  if ((options->spin < 0) || (options->busyPoll < 0)) {
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+#if !defined(__linux__)
+  if (options->busyPoll || options->preferBusyPoll) {
+    fprintf(stderr, "fnet_busypoll: socket busy polling is linux-only\n");
+    return FNET_RETURNCODE_NOT_IMPLEMENTED;
+  }
+#else
+  // Both usually need CAP_NET_ADMIN, find out here instead of on every socket
+  if (options->busyPoll || options->preferBusyPoll) {
+    struct fnet_busypoll_t previous = busypoll;
+    FNET_SOCKET            fd       = socket(AF_INET, SOCK_STREAM, 0);
+    FNET_RETURNCODE        ret;
+    if (fd < 0) return FNET_RETURNCODE_ERRNO;
+    busypoll = *options;
+    ret      = _fnet_sockopts(fd);
+    if (ret < 0) {
+      fprintf(stderr, "fnet_busypoll: %s\n", strerror(errno));
+      busypoll = previous;
+    }
+    close(fd);
+    if (ret < 0) return ret;
+  }
+#endif
+  busypoll = *options;
+  return FNET_RETURNCODE_OK;
+}
+
+FNET_RETURNCODE fnet_fairness(const struct fnet_fairness_t *options) {
+  if (!options) {
+    fprintf(stderr, "fnet_fairness: options argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  fairness = *options;
+  return FNET_RETURNCODE_OK;
+}
+
+FNET_RETURNCODE fnet_pin(int cpu) {
+#if defined(__linux__)
+  cpu_set_t     set;
+  unsigned int  node = 0;
+  unsigned long nodemask;
+  if (cpu < 0) {
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set)) {
+    fprintf(stderr, "fnet_pin: %s\n", strerror(errno));
+    return FNET_RETURNCODE_ERRNO;
+  }
+  loopcpu = cpu;
+
+  // Prefer the node we now run on for everything allocated from here on
+  // Not fatal, a single-node machine or kernel without NUMA is fine as-is
+  if (!syscall(SYS_getcpu, NULL, &node, NULL) && (node < (sizeof(nodemask) * 8))) {
+    nodemask = 1UL << node;
+    syscall(SYS_set_mempolicy, FNET_MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8);
+  }
+  return FNET_RETURNCODE_OK;
+#else
+  return FNET_RETURNCODE_NOT_IMPLEMENTED;
+#endif
+}
+
+FNET_RETURNCODE fnet_stats(struct fnet_stats_t *out) {
+  if (!out) {
+    fprintf(stderr, "fnet_stats: out argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  *out = stats;
+  return FNET_RETURNCODE_OK;
+}
+
+FNET_RETURNCODE fnet_rcvlowat(const struct fnet_t *connection, int bytes) {
+  struct fnet_internal_t *conn = (struct fnet_internal_t *)connection;
+  int i;
+
+  // Checking arguments are given
+  if (!conn) {
+    fprintf(stderr, "fnet_rcvlowat: connection argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+
+  conn->rcvlowat = bytes;
+  if (conn->ext.status & FNET_STATUS_LISTENING) return FNET_RETURNCODE_OK;
+
+  for ( i = 0 ; i < conn->nfds ; i++ ) {
+    if (setsockopt(conn->fds[i], SOL_SOCKET, SO_RCVLOWAT, (void*)&(int){bytes ? bytes : 1}, sizeof(int))) {
+      return FNET_RETURNCODE_ERRNO;
+    }
+  }
+  return FNET_RETURNCODE_OK;
+}
+
+// Stops reading from the connection, the kernel's buffers fill up and push back on the peer
+FNET_RETURNCODE fnet_readable(const struct fnet_t *connection, bool readable) {
+  struct fnet_internal_t *conn = (struct fnet_internal_t *)connection;
+
+  // Checking arguments are given
+  if (!conn) {
+    fprintf(stderr, "fnet_readable: connection argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+
+  conn->held = !readable;
+  if (conn->rpaused == !readable) return FNET_RETURNCODE_OK;
+  if (conn->ext.status & FNET_STATUS_CLOSED) return FNET_RETURNCODE_OK;
+
+  // Still waiting for the queue to drain when short on memory
+  if (readable && memtight && conn->wbuf.len) return FNET_RETURNCODE_OK;
+  conn->rpaused = !readable;
+  _fnet_poll(conn);
+
+  // Shared memory peers don't ring again for what's already in the ring
+  if (readable && conn->shm) _fnet_enqueue(conn, 0);
+  return FNET_RETURNCODE_OK;
+}
+
+// Bytes a connection may read per pass
+size_t _fnet_budget(struct fnet_internal_t *conn) {
+  if ((conn->priority == FNET_PRIORITY_BULK) && fairness.bulkBudget) return fairness.bulkBudget;
+  return fairness.budget ? fairness.budget : FNET_RECV_MAX;
+}
+
+// Reads everything pending on the fd into the connection's rbuf
+// Returns the amount of bytes read, 0 on EOF or -1 with errno set
+ssize_t _fnet_recv(struct fnet_internal_t *conn, FNET_SOCKET fd) {
+  ssize_t n;
+  ssize_t left = 0;
+  size_t  want;
+  size_t  budget = _fnet_budget(conn);
+#if defined(_WIN32) || defined(_WIN64)
+  u_long  pending = 0;
+#else
+  int     pending = 0;
+#endif
+
+  conn->rbuf.len = 0;
+
+  // Ask the kernel how much is waiting, saving the recv that'd hit EAGAIN
+  if (conn->flags & FNET_FLAG_FIONREAD) {
+#if defined(_WIN32) || defined(_WIN64)
+    if (ioctlsocket(fd, FIONREAD, &pending)) pending = 0;
+#else
+    if (ioctl(fd, FIONREAD, &pending)) pending = 0;
+#endif
+    left = pending;
+  }
+
+  for(;;) {
+    want = conn->rsize;
+    if (left > 0) want = (left < FNET_RECV_MAX) ? (size_t)left : FNET_RECV_MAX;
+    if (want > (budget - conn->rbuf.len)) want = budget - conn->rbuf.len;
+    if ((conn->rbuf.cap - conn->rbuf.len) < want) {
+      char *data = realloc(conn->rbuf.data, conn->rbuf.len + want);
+      if (!data) {
+        errno = ENOMEM;
+        return -1;
+      }
+      conn->rbuf.data = data;
+      conn->rbuf.cap  = conn->rbuf.len + want;
+    }
+
+    n = recv(fd, conn->rbuf.data + conn->rbuf.len, want, 0);
+    FNET_TRACE(RECV, conn, n);
+    if (n < 0) {
+      if (conn->rbuf.len) break;
+      return -1;
+    }
+    conn->rbuf.len += n;
+
+    // Enough for one pass, the rest is picked up on the next
+    if (conn->rbuf.len >= budget) break;
+
+    // Short read, the socket is drained
+    if ((size_t)n < want) break;
+    if (left > 0) {
+      left -= n;
+      if (left <= 0) break;
+      continue;
+    }
+
+    // Filled the whole request, allow bigger reads
+    if (conn->rsize < FNET_RECV_MAX) conn->rsize <<= 1;
+  }
+
+  // Shrink back towards what the traffic looks like
+  if (((conn->rbuf.len << 2) < conn->rsize) && (conn->rsize > FNET_RECV_MIN)) {
+    conn->rsize >>= 1;
+    if (conn->rbuf.cap > (conn->rsize << 2)) {
+      // Still holds what we just read, len < rsize here
+      char *data = realloc(conn->rbuf.data, conn->rsize);
+      if (data) {
+        conn->rbuf.data = data;
+        conn->rbuf.cap  = conn->rsize;
+      }
+    }
+  }
+
+  return conn->rbuf.len;
+}
+
+// Doorbell first, the rendezvous socket is only polled to notice the peer hanging up
+FNET_RETURNCODE _fnet_shm_attach(struct fnet_internal_t *conn, struct fnet_shm_t *shm) {
+  conn->fds = malloc(2 * sizeof(FNET_SOCKET));
+  if (!conn->fds) {
+    fprintf(stderr, "%s\n", strerror(ENOMEM));
+    close(shm->bell);
+    close(shm->ctl);
+    _fnet_shm_free(shm);
+    return FNET_RETURNCODE_ERRNO;
+  }
+  conn->fds[0] = shm->bell;
+  conn->fds[1] = shm->ctl;
+  conn->nfds   = 2;
+  conn->shm    = shm;
+  return FNET_RETURNCODE_OK;
+}
+
+// Tracks a connection accepted by the listener, its socket already set up
+struct fnet_internal_t * _fnet_accepted(struct fnet_internal_t *conn, FNET_SOCKET nfd, struct fnet_shm_t *shm) {
+  struct fnet_internal_t *nconn;
+
+  // Create new fnet_t instance
+  // _init already tracks the connection
+  nconn = _fnet_init(&((struct fnet_options_t){
+    .proto     = conn->ext.proto,
+    .flags     = conn->flags & (~FNET_FLAG_RECONNECT),
+    .onListen  = NULL,
+    .onConnect = NULL,
+    .onData    = NULL,
+    .onTick    = NULL,
+    .onClose   = NULL,
+    .udata     = NULL,
+    .rcvLowat  = conn->rcvlowat,
+    .priority  = conn->priority,
+  }));
+
+  if (shm) {
+    if (_fnet_shm_attach(nconn, shm) < 0) {
+      fnet_free((struct fnet_t *)nconn);
+      return NULL;
+    }
+  } else {
+    nconn->fds    = malloc(sizeof(FNET_SOCKET));
+    nconn->fds[0] = nfd;
+    nconn->nfds   = 1;
+  }
+  nconn->ext.status = FNET_STATUS_CONNECTED | FNET_STATUS_ACCEPTED;
+  nconn->parent     = conn;
+  nconn->owned      = true;
+#if defined(__linux__)
+  if (getsockopt(nfd, SOL_SOCKET, SO_INCOMING_CPU, &(nconn->ext.cpu), &(socklen_t){sizeof(int)})) {
+    nconn->ext.cpu = -1;
+  }
+  if ((loopcpu >= 0) && (nconn->ext.cpu >= 0) && (nconn->ext.cpu != loopcpu)) {
+    stats.remoteAccepts++;
+  }
+#endif
+  conn->nconns++;
+  accepted++;
+  FNET_TRACE(ACCEPT, nconn, nfd);
+  FNET_CAPTURE(ACCEPT, nconn, NULL, 0);
+  return nconn;
+}
+
+// Introduces an accepted connection to the application, then starts polling it
+void _fnet_welcome(struct fnet_internal_t *conn, struct fnet_internal_t *nconn) {
+  if (conn->ext.onConnect) {
+    FNET_TRACE(CB_ENTER, nconn, FNET_EVENT_CONNECT);
+    conn->ext.onConnect(&((struct fnet_ev){
+      .connection = (struct fnet_t *)nconn,
+      .type       = FNET_EVENT_CONNECT,
+      .buffer     = NULL,
+      .udata      = conn->ext.udata,
+    }));
+    FNET_TRACE(CB_EXIT, nconn, FNET_EVENT_CONNECT);
+  }
+  if (nconn->ext.status & FNET_STATUS_CLOSED) return;
+
+  // Whatever the peer wrote before being accepted is picked up right away
+  if (nconn->shm) {
+    _fnet_poll(nconn);
+    _fnet_enqueue(nconn, 0);
+  } else if (nconn->wantout) {
+    _fnet_poll(nconn);
+  } else if (fpfd) {
+    fpoll_add(fpfd, FNET_POLL_READ | FPOLL_HUP, nconn->fds[0], nconn);
+  }
+}
+
+// Waits for a shared memory peer's rings from the loop, it's dropped when they don't come in time
+// Counts towards the listener's limits meanwhile
+void _fnet_greet(struct fnet_internal_t *conn, FNET_SOCKET nfd) {
+  struct fnet_internal_t *pending = _fnet_init(&((struct fnet_options_t){ .proto = FNET_PROTO_SHM }));
+
+  pending->fds = malloc(sizeof(FNET_SOCKET));
+  if (!pending->fds) {
+    close(nfd);
+    fnet_free((struct fnet_t *)pending);
+    return;
+  }
+  pending->fds[0]     = nfd;
+  pending->nfds       = 1;
+  pending->ext.status = FNET_STATUS_ACCEPTED;
+  pending->parent     = conn;
+  pending->owned      = true;
+  pending->greeting   = true;
+  pending->linger     = FNET_SHM_GREET;
+  conn->nconns++;
+  accepted++;
+  if (fpfd) fpoll_add(fpfd, FNET_POLL_READ | FPOLL_HUP, nfd, pending);
+}
+
+// The peer's rings arrived or it hung up, either way the waiting is over
+void _fnet_greeted(struct fnet_internal_t *pending) {
+  struct fnet_internal_t *conn = pending->parent;
+  struct fnet_internal_t *nconn;
+  struct fnet_shm_t      *shm;
+  FNET_SOCKET            nfd = pending->fds[0];
+
+  // The socket goes to the handshake, which closes it on failure
+  if (fpfd) fpoll_del(fpfd, ~0, nfd);
+  pending->nfds = 0;
+  fnet_close((struct fnet_t *)pending);
+
+  shm = _fnet_shm_accept(nfd);
+  if (!shm) return;
+
+  // The listener went away meanwhile
+  if (!conn) {
+    close(shm->bell);
+    close(shm->ctl);
+    _fnet_shm_free(shm);
+    return;
+  }
+
+  nconn = _fnet_accepted(conn, nfd, shm);
+  if (!nconn) return;
+  if (conn->rate) conn->tokens -= 1000;
+  _fnet_welcome(conn, nconn);
+}
+
+// Same family, address and port
+bool _fnet_sameaddr(const struct sockaddr *a, const struct sockaddr *b) {
+  if (a->sa_family != b->sa_family) return false;
+  if (a->sa_family == AF_INET) {
+    return (((const struct sockaddr_in *)a)->sin_port == ((const struct sockaddr_in *)b)->sin_port) &&
+      !memcmp(&(((const struct sockaddr_in *)a)->sin_addr), &(((const struct sockaddr_in *)b)->sin_addr), sizeof(struct in_addr));
+  }
+  if (a->sa_family == AF_INET6) {
+    return (((const struct sockaddr_in6 *)a)->sin6_port == ((const struct sockaddr_in6 *)b)->sin6_port) &&
+      !memcmp(&(((const struct sockaddr_in6 *)a)->sin6_addr), &(((const struct sockaddr_in6 *)b)->sin6_addr), sizeof(struct in6_addr));
+  }
+#if !defined(_WIN32) && !defined(_WIN64)
+  if (a->sa_family == AF_UNIX) {
+    return !memcmp(((const struct sockaddr_un *)a)->sun_path, ((const struct sockaddr_un *)b)->sun_path, sizeof(((const struct sockaddr_un *)a)->sun_path));
+  }
+#endif
+  return false;
+}
+
+// An inherited listening socket bound to addr, the connections it accepted go along with it
+FNET_SOCKET _fnet_inherit(struct fnet_internal_t *conn, const struct sockaddr *addr) {
+  struct sockaddr_storage bound;
+  socklen_t len;
+  FNET_SOCKET fd;
+  size_t i, j;
+
+  for ( i = 0 ; i < ninherited ; i++ ) {
+    if ((inherited[i].rec.type != FNET_HANDOVER_LISTENER) || (inherited[i].fd < 0)) continue;
+    if (inherited[i].rec.proto != conn->ext.proto) continue;
+    memset(&bound, 0, sizeof(bound));
+    len = sizeof(bound);
+    if (getsockname(inherited[i].fd, (struct sockaddr *)&bound, &len)) continue;
+    if (!_fnet_sameaddr((struct sockaddr *)&bound, addr)) continue;
+
+    fd = inherited[i].fd;
+    inherited[i].fd = -1;
+    for ( j = 0 ; j < ninherited ; j++ ) {
+      if ((inherited[j].rec.type == FNET_HANDOVER_CONNECTION) && (inherited[j].rec.id == inherited[i].rec.id)) {
+        inherited[j].claimed = conn;
+      }
+    }
+    return fd;
+  }
+  return -1;
+}
+
+// Picks up the connections that came along with the listener's sockets
+void _fnet_inherit_connections(struct fnet_internal_t *conn) {
+  struct fnet_internal_t *nconn;
+  size_t i;
+
+  for ( i = 0 ; i < ninherited ; i++ ) {
+    if ((inherited[i].claimed != conn) || (inherited[i].fd < 0)) continue;
+    if (conn->ext.status & FNET_STATUS_CLOSED) return;
+
+    setnonblock(inherited[i].fd);
+    nconn = _fnet_accepted(conn, inherited[i].fd, NULL);
+    inherited[i].fd = -1;
+    if (!nconn) continue;
+
+    // What the previous process still had to send goes out first
+    nconn->wbuf       = inherited[i].wbuf;
+    nconn->wantout    = nconn->wbuf.len > 0;
+    inherited[i].wbuf = (struct buf){};
+    _fnet_account(nconn);
+    _fnet_welcome(conn, nconn);
+
+    // Followed by what it received but didn't get to
+    if (inherited[i].rbuf.len && !(nconn->ext.status & FNET_STATUS_CLOSED)) {
+      nconn->rbuf       = inherited[i].rbuf;
+      inherited[i].rbuf = (struct buf){};
+      _fnet_received(nconn);
+      _fnet_account(nconn);
+    }
+  }
+}
+
+// Whatever wasn't claimed is closed, those peers reconnect
+void _fnet_inherit_release() {
+  size_t i;
+
+  for ( i = 0 ; i < ninherited ; i++ ) {
+    if (inherited[i].fd >= 0) {
+#if defined(_WIN32) || defined(_WIN64)
+      closesocket(inherited[i].fd);
+#else
+      close(inherited[i].fd);
+#endif
+    }
+    if (inherited[i].wbuf.data) free(inherited[i].wbuf.data);
+    if (inherited[i].rbuf.data) free(inherited[i].rbuf.data);
+  }
+  if (inherited) free(inherited);
+  inherited  = NULL;
+  ninherited = 0;
+}
+
+// Binds and listens on every resolved address
+// For example, "localhost" turned to "127.0.0.1" and "::1"
+FNET_RETURNCODE _fnet_listen_addrs(struct fnet_internal_t *conn, const struct addrinfo *addrs) {
+  const struct addrinfo *addrinfo;
+  FNET_SOCKET fd;
+  int naddrs = 0;
+
+  for ( addrinfo = addrs ; addrinfo ; addrinfo = addrinfo->ai_next ) {
+    naddrs++;
+  }
+
+  conn->fds = malloc(naddrs * sizeof(FNET_SOCKET));
+  if (!conn->fds) {
+    fprintf(stderr, "%s\n", strerror(ENOMEM));
+    return FNET_RETURNCODE_ERRNO;
+  }
+
+  for ( addrinfo = addrs ; addrinfo ; addrinfo = addrinfo->ai_next ) {
+
+    // Handed over by the previous process, already listening with its backlog intact
+    fd = _fnet_inherit(conn, addrinfo->ai_addr);
+    if (fd >= 0) {
+      conn->fds[conn->nfds] = fd;
+      conn->nfds++;
+      if (setnonblock(fd) < 0) {
+        fprintf(stderr, "setnonblock\n");
+        return FNET_RETURNCODE_ERROR;
+      }
+      if (fpfd) {
+        fpoll_add(fpfd, FPOLL_IN | FPOLL_HUP, fd, conn);
+      }
+      continue;
+    }
+
+    fd = socket(addrinfo->ai_family, addrinfo->ai_socktype, addrinfo->ai_protocol);
+    if (fd < 0) {
+      fprintf(stderr, "socket\n");
+      return FNET_RETURNCODE_ERROR;
+    }
+
+    // Closed along with the connection from here on
+    conn->fds[conn->nfds] = fd;
+    conn->nfds++;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
+      fprintf(stderr, "setsockopt(SO_REUSEADDR)\n");
+      return FNET_RETURNCODE_ERROR;
+    }
+
+#if defined(SO_REUSEPORT)
+    if ((conn->flags & (FNET_FLAG_REUSEPORT | FNET_FLAG_CPU_STEER)) && (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0)) {
+      fprintf(stderr, "setsockopt(SO_REUSEPORT)\n");
+      return FNET_RETURNCODE_ERROR;
+    }
+#endif
+
+#if defined(__linux__)
+    // Have the kernel prefer this listener for connections arriving on our cpu
+    if ((conn->flags & FNET_FLAG_REUSEPORT) && (loopcpu >= 0)) {
+      setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &loopcpu, sizeof(int));
+    }
+#endif
+
+    if (setnonblock(fd) < 0) {
+      fprintf(stderr, "setnonblock\n");
+      return FNET_RETURNCODE_ERROR;
+    }
+
+    if (bind(fd, addrinfo->ai_addr, addrinfo->ai_addrlen) < 0) {
+      fprintf(stderr, "bind: %s\n", strerror(errno));
+      return FNET_RETURNCODE_ERRNO;
+    }
+
+    if (listen(fd, SOMAXCONN) < 0) {
+      fprintf(stderr, "listen: %s\n", strerror(errno));
+      return FNET_RETURNCODE_ERRNO;
+    }
+
+    if ((conn->flags & FNET_FLAG_CPU_STEER) && (_fnet_steer(fd) < 0)) {
+      fprintf(stderr, "setsockopt(SO_ATTACH_REUSEPORT_CBPF): %s\n", strerror(errno));
+      return FNET_RETURNCODE_ERRNO;
+    }
+
+    if (fpfd) {
+      fpoll_add(fpfd, FPOLL_IN | FPOLL_HUP, fd, conn);
+    }
+  }
+
+  return FNET_RETURNCODE_OK;
+}
+
+void _fnet_listen_resolved(const struct addrinfo *addrs, int error, void *udata) {
+  struct fnet_internal_t *conn = udata;
+  bool pending = conn->resolving != NULL;
+  conn->resolving = NULL;
+
+  if (error) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
+  }
+  if (error || (_fnet_listen_addrs(conn, addrs) < 0)) {
+    // Still inside fnet_listen, which reports the failure
+    if (!pending) {
+      conn->ext.status = FNET_STATUS_ERROR;
+      return;
+    }
+    fnet_close((struct fnet_t *)conn);
+    return;
+  }
+
+  _fnet_emit(conn, conn->ext.onListen, FNET_EVENT_LISTEN);
+  conn->ext.status = FNET_STATUS_LISTENING;
+  _fnet_inherit_connections(conn);
+}
+
+// Shared memory listeners are a unix socket named after the address, nothing to resolve
+FNET_RETURNCODE _fnet_listen_shm(struct fnet_internal_t *conn, const char *name) {
+#if defined(__linux__)
+  struct sockaddr_un addr;
+#endif
+
+  conn->fds = malloc(sizeof(FNET_SOCKET));
+  if (!conn->fds) {
+    fprintf(stderr, "%s\n", strerror(ENOMEM));
+    return FNET_RETURNCODE_ERRNO;
+  }
+  conn->fds[0] = -1;
+#if defined(__linux__)
+  if (_fnet_shm_addr(name, &addr)) conn->fds[0] = _fnet_inherit(conn, (struct sockaddr *)&addr);
+#endif
+  if (conn->fds[0] < 0) conn->fds[0] = _fnet_shm_listen(name);
+  if (conn->fds[0] < 0) {
+    fprintf(stderr, "fnet_listen: %s\n", strerror(errno));
+    return FNET_RETURNCODE_ERRNO;
+  }
+  conn->nfds = 1;
+
+  if (fpfd) {
+    fpoll_add(fpfd, FPOLL_IN | FPOLL_HUP, conn->fds[0], conn);
+  }
+
+  _fnet_emit(conn, conn->ext.onListen, FNET_EVENT_LISTEN);
+  conn->ext.status = FNET_STATUS_LISTENING;
+  return FNET_RETURNCODE_OK;
+}
+
+struct fnet_t * fnet_listen(const char *address, uint16_t port, const struct fnet_options_t *options) {
+  struct fnet_internal_t *conn;
+
+#if defined(_WIN32) || defined(_WIN64)
+  if (!w32_initialized) {
+    WSADATA wsaData;
+    int err = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (err) {
+      fprintf(stderr, "fnet_listen: WSAStartup\n");
+      return NULL;
+    }
+    w32_initialized = true;
+  }
+#endif
+
+  // Checking arguments are given
+  if (!address) {
+    fprintf(stderr, "fnet_listen: address argument is required\n");
+    return NULL;
+  }
+  if (!options) {
+    fprintf(stderr, "fnet_listen: options argument is required\n");
+    return NULL;
+  }
+  if (!port && (options->proto != FNET_PROTO_SHM)) {
+    fprintf(stderr, "fnet_listen: port argument is required\n");
+    return NULL;
+  }
+
+  // Check if we support the protocol
+  switch(options->proto) {
+    case FNET_PROTO_TCP:
+      // Intentionally empty
+      // TODO: tcp-specific arg validation
+      break;
+    case FNET_PROTO_SHM:
+      // Address is the name, port is ignored
+      break;
+    default:
+      fprintf(stderr, "fnet_listen: unknown protocol\n");
+      return NULL;
+  }
+
+  // 1-to-1 copy, don't touch the options
+  conn = _fnet_init(options);
+
+  if (conn->ext.proto == FNET_PROTO_SHM) {
+    if (_fnet_listen_shm(conn, address) < 0) {
+      fnet_free((struct fnet_t *)conn);
+      return NULL;
+    }
+    return (struct fnet_t *)conn;
+  }
+
+  // Finishes in _fnet_listen_resolved, before returning unless the name is looked up off the loop
+  conn->resolving = fnet_resolve(address, port, _fnet_listen_resolved, conn);
+  if (conn->ext.status & FNET_STATUS_ERROR) {
+    fnet_free((struct fnet_t *)conn);
+    return NULL;
+  }
+
+  return (struct fnet_t *)conn;
+}
+
+// Connects to the first resolved address that accepts
+FNET_RETURNCODE _fnet_connect_addrs(struct fnet_internal_t *conn, const struct addrinfo *addrs) {
+  const struct addrinfo *addrinfo;
+  FNET_SOCKET fd;
+
+  conn->fds = malloc(sizeof(FNET_SOCKET));
+  if (!conn->fds) {
+    fprintf(stderr, "%s\n", strerror(ENOMEM));
+    return FNET_RETURNCODE_ERRNO;
+  }
+
+  for ( addrinfo = addrs ; addrinfo ; addrinfo = addrinfo->ai_next ) {
+
+    fd = socket(addrinfo->ai_family, addrinfo->ai_socktype, addrinfo->ai_protocol);
+    if (fd < 0) {
+      fprintf(stderr, "socket\n");
+      return FNET_RETURNCODE_ERROR;
+    }
+
+    // Skip found address on failure to connect
+    if (connect(fd, addrinfo->ai_addr, addrinfo->ai_addrlen)) {
+#if defined(_WIN32) || defined(_WIN64)
+      closesocket(fd);
+#else
+      close(fd);
+#endif
+      continue;
+    }
+
+    if (conn->rcvlowat) {
+      setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, (void*)&(conn->rcvlowat), sizeof(int));
+    }
+    _fnet_sockopts(fd);
+
+    if (setnonblock(fd) < 0) {
+#if defined(_WIN32) || defined(_WIN64)
+      closesocket(fd);
+#else
+      close(fd);
+#endif
+      fprintf(stderr, "setnonblock\n");
+      return FNET_RETURNCODE_ERROR;
+    }
+
+    conn->fds[0] = fd;
+    conn->nfds   = 1;
+
+    if (fpfd) {
+      fpoll_add(fpfd, FNET_POLL_READ | FPOLL_HUP, fd, conn);
+    }
+
+    // Only need 1 connection
+    return FNET_RETURNCODE_OK;
+  }
+
+  // Could not connect, might be unreachable, might be something else
+  // We're not checking for the WHY here
+  return FNET_RETURNCODE_ERROR;
+}
+
+void _fnet_connect_resolved(const struct addrinfo *addrs, int error, void *udata) {
+  struct fnet_internal_t *conn = udata;
+  bool pending = conn->resolving != NULL;
+  conn->resolving = NULL;
+
+  if (error) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
+  }
+  if (error || (_fnet_connect_addrs(conn, addrs) < 0)) {
+    // Still inside fnet_connect, which reports the failure
+    if (!pending) {
+      conn->ext.status = FNET_STATUS_ERROR;
+      return;
+    }
+    // A failed lookup has no errno of its own, connect left the last one
+    conn->ext.error = error ? EHOSTUNREACH : errno;
+    fnet_close((struct fnet_t *)conn);
+    return;
+  }
+
+  conn->ext.status = FNET_STATUS_CONNECTED;
+  FNET_CAPTURE(CONNECT, conn, NULL, 0);
+
+  // Written to or ended while resolving
+  if (conn->wbuf.len) {
+    _fnet_arm(conn, true);
+  } else if (conn->shutwr) {
+    _fnet_shutwr(conn);
+  }
+
+  _fnet_emit(conn, conn->ext.onConnect, FNET_EVENT_CONNECT);
+}
+
+// Hands the rings to the listener named by the address, connected once that's sent
+FNET_RETURNCODE _fnet_connect_shm(struct fnet_internal_t *conn, const char *name) {
+  struct fnet_shm_t *shm = _fnet_shm_connect(name, conn->shmsize);
+
+  if (!shm) {
+    fprintf(stderr, "fnet_connect: %s\n", strerror(errno));
+    return FNET_RETURNCODE_ERRNO;
+  }
+  if (_fnet_shm_attach(conn, shm) < 0) return FNET_RETURNCODE_ERRNO;
+
+  conn->ext.status = FNET_STATUS_CONNECTED;
+  _fnet_poll(conn);
+  _fnet_enqueue(conn, 0);
+  FNET_CAPTURE(CONNECT, conn, NULL, 0);
+  _fnet_emit(conn, conn->ext.onConnect, FNET_EVENT_CONNECT);
+  return FNET_RETURNCODE_OK;
+}
+
+struct fnet_t * fnet_connect(const char *address, uint16_t port, const struct fnet_options_t *options) {
+  struct fnet_internal_t *conn;
+
+  // Checking arguments are given
+  if (!address) {
+    fprintf(stderr, "fnet_connect: address argument is required\n");
     return NULL;
   }
   if (!options) {
     fprintf(stderr, "fnet_connect: options argument is required\n");
     return NULL;
   }
+  if (!port && (options->proto != FNET_PROTO_SHM)) {
+    fprintf(stderr, "fnet_connect: port argument is required\n");
+    return NULL;
+  }
 
   // Check if we support the protocol
   switch(options->proto) {
     case FNET_PROTO_TCP:
       // Intentionally empty
       break;
+    case FNET_PROTO_SHM:
+      // Address is the name, port is ignored
+      break;
     default:
       fprintf(stderr, "fnet_connect: unknown protocol\n");
       return NULL;
@@ -299,123 +1731,281 @@ struct fnet_t * fnet_connect(const char *address, uint16_t port, const struct fn
 
   // 1-to-1 copy, don't touch the options
   conn = _fnet_init(options);
+  conn->ext.status = FNET_STATUS_CONNECTING;
+
+  if (conn->ext.proto == FNET_PROTO_SHM) {
+    if (_fnet_connect_shm(conn, address) < 0) {
+      fnet_free((struct fnet_t *)conn);
+      return NULL;
+    }
+    return (struct fnet_t *)conn;
+  }
+
+  // Finishes in _fnet_connect_resolved, before returning unless the name is looked up off the loop
+  conn->resolving = fnet_resolve(address, port, _fnet_connect_resolved, conn);
+  if (conn->ext.status & FNET_STATUS_ERROR) {
+    fnet_free((struct fnet_t *)conn);
+    return NULL;
+  }
+
+  return (struct fnet_t *)conn;
+}
+
+// Wraps an already connected socket, fnet owns it from here on
+struct fnet_t * fnet_adopt(int fd, const struct fnet_options_t *options) {
+  struct fnet_internal_t *conn;
+
+  // Checking arguments are given
+  if (fd < 0) {
+    fprintf(stderr, "fnet_adopt: fd argument is required\n");
+    return NULL;
+  }
+  if (!options) {
+    fprintf(stderr, "fnet_adopt: options argument is required\n");
+    return NULL;
+  }
+
+  if (setnonblock(fd) < 0) {
+    fprintf(stderr, "setnonblock\n");
+    return NULL;
+  }
+
+  conn = _fnet_init(options);
+  conn->fds = malloc(sizeof(FNET_SOCKET));
+  if (!conn->fds) {
+    fprintf(stderr, "%s\n", strerror(ENOMEM));
+    fnet_free((struct fnet_t *)conn);
+    return NULL;
+  }
+  conn->fds[0]     = fd;
+  conn->nfds       = 1;
+  conn->ext.status = FNET_STATUS_CONNECTED;
+
+  if (conn->rcvlowat) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, (void*)&(conn->rcvlowat), sizeof(int));
+  }
+  _fnet_sockopts(fd);
+
+  if (fpfd) {
+    fpoll_add(fpfd, FNET_POLL_READ | FPOLL_HUP, fd, conn);
+  }
+
+  _fnet_emit(conn, conn->ext.onConnect, FNET_EVENT_CONNECT);
+
+  return (struct fnet_t *)conn;
+}
 
-  /* struct sockaddr_in servaddr; */
-  struct addrinfo hints = {}, *addrs;
-  char port_str[6] = {};
+// Pending error of the socket, clears it
+int _fnet_sockerror(FNET_SOCKET fd) {
+  int       error = 0;
+  socklen_t len   = sizeof(error);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void*)&error, &len)) return errno;
+  return error;
+}
 
-  hints.ai_family   = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
+void _fnet_fail(struct fnet_internal_t *conn, int error) {
+  conn->ext.error = error;
+  fnet_close((struct fnet_t *)conn);
+}
 
-  // Get address info
-  snprintf(port_str, sizeof(port_str), "%d", port);
-  int ai_err = getaddrinfo(address, port_str, &hints, &addrs);
-  if (ai_err != 0) {
-    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ai_err));
-    fnet_free((struct fnet_t *)conn);
-    return NULL;
+// The peer won't send anymore, without onEnd there's nothing left to do but close
+void _fnet_eof(struct fnet_internal_t *conn) {
+  if (!conn->ext.onEnd) {
+    fnet_close((struct fnet_t *)conn);
+    return;
   }
 
-  // Count the addresses to listen on
-  // For example, "localhost" turned to "127.0.0.1" and "::1"
-  struct addrinfo *addrinfo = addrs;
-  while(addrinfo) {
-    addrinfo = addrinfo->ai_next;
-  }
+  conn->ext.status |= FNET_STATUS_END;
+  _fnet_poll(conn);
+  _fnet_emit(conn, conn->ext.onEnd, FNET_EVENT_END);
 
-  conn->fds = malloc(sizeof(FNET_SOCKET));
-  if (!conn->fds) {
-    fprintf(stderr, "%s\n", strerror(ENOMEM));
-    fnet_free((struct fnet_t *)conn);
-    freeaddrinfo(addrs);
-    return NULL;
+  // Both directions are done
+  if (conn->shutwr && !conn->wbuf.len && !(conn->ext.status & FNET_STATUS_CLOSED)) {
+    fnet_close((struct fnet_t *)conn);
   }
+}
 
-  addrinfo = addrs;
-  for (; addrinfo ; addrinfo = addrinfo->ai_next ) {
+// The next process connected, hands it everything and lets go once it confirmed
+// Blocks the loop while sending, so nothing changes underneath the snapshot it sends
+// Each send and receive is bounded by FNET_HANDOVER_TIMEOUT
+void _fnet_handover_serve(struct fnet_internal_t *conn) {
+  struct fnet_handover_t   *options = conn->handover;
+  struct fnet_internal_t   *c;
+  struct fnet_handover_rec rec;
+  struct fnet_ev           ev;
+  struct buf               input;
+  FNET_SOCKET              sock;
+  char                     done;
+  bool                     ok;
+  int                      i;
+#if !defined(_WIN32) && !defined(_WIN64)
+  struct sockaddr_un       addr    = {};
+  socklen_t                addrlen = sizeof(addr);
+#endif
 
-    FNET_SOCKET fd = socket(addrinfo->ai_family, addrinfo->ai_socktype, addrinfo->ai_protocol);
-    if (fd < 0) {
-      fprintf(stderr, "socket\n");
-      fnet_free((struct fnet_t *)conn);
-      freeaddrinfo(addrs);
-      return NULL;
+  sock = accept(conn->fds[0], NULL, NULL);
+  if (sock < 0) return;
+  setblock(sock);
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (void*)&((struct timeval){ .tv_sec = FNET_HANDOVER_TIMEOUT }), sizeof(struct timeval));
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void*)&((struct timeval){ .tv_sec = FNET_HANDOVER_TIMEOUT }), sizeof(struct timeval));
+  ok = !_fnet_handover_write(sock, FNET_HANDOVER_MAGIC, 8);
+
+  // Listeners first, connections refer to them
+  for ( c = connections ; ok && c ; c = c->next ) {
+    if (c->handover || (c->ext.status != FNET_STATUS_LISTENING)) continue;
+    for ( i = 0 ; ok && (i < c->nfds) ; i++ ) {
+      rec = (struct fnet_handover_rec){ .type = FNET_HANDOVER_LISTENER, .proto = c->ext.proto, .id = c->id };
+      ok  = !_fnet_handover_send(sock, &rec, c->fds[i], NULL, NULL);
     }
+    c->handed = ok;
+  }
 
-    // Skip found address on failure to connect
-    if (connect(fd, addrinfo->ai_addr, sizeof(struct sockaddr))) {
-#if defined(_WIN32) || defined(_WIN64)
-      closesocket(fd);
-#else
-      close(fd);
-#endif
-      continue;
+  // Only TCP connections open in both directions, whose listener moves along
+  for ( c = connections ; ok && options->connections && c ; c = c->next ) {
+    if (c->ext.status != (FNET_STATUS_CONNECTED | FNET_STATUS_ACCEPTED)) continue;
+    if ((c->ext.proto != FNET_PROTO_TCP) || c->shutwr || !c->parent || !c->parent->handed) continue;
+
+    input = (struct buf){};
+    ev    = (struct fnet_ev){
+      .connection = (struct fnet_t *)c,
+      .type       = FNET_EVENT_HANDOVER,
+      .buffer     = &input,
+      .udata      = c->ext.udata,
+    };
+    if (options->onHandover) {
+      FNET_TRACE(CB_ENTER, c, FNET_EVENT_HANDOVER);
+      options->onHandover(&ev);
+      FNET_TRACE(CB_EXIT, c, FNET_EVENT_HANDOVER);
     }
+    if (ev.buffer && !(c->ext.status & FNET_STATUS_CLOSED)) {
+      rec = (struct fnet_handover_rec){
+        .type  = FNET_HANDOVER_CONNECTION,
+        .proto = c->ext.proto,
+        .id    = c->parent->id,
+        .wlen  = c->wbuf.len,
+        .rlen  = input.len,
+      };
+      ok        = !_fnet_handover_send(sock, &rec, c->fds[0], c->wbuf.data, input.data);
+      c->handed = ok;
+    }
+    if (input.data) free(input.data);
+  }
 
-    if (setnonblock(fd) < 0) {
+  if (ok) {
+    rec = (struct fnet_handover_rec){ .type = FNET_HANDOVER_END };
+    ok  = !_fnet_handover_send(sock, &rec, -1, NULL, NULL) && !_fnet_handover_read(sock, &done, 1);
+  }
+
+  // Everything stays here, the next attempt sends it all again
+  if (!ok) {
+    fprintf(stderr, "fnet_handover: %s\n", strerror(errno));
+    for ( c = connections ; c ; c = c->next ) c->handed = false;
 #if defined(_WIN32) || defined(_WIN64)
-      closesocket(fd);
+    closesocket(sock);
 #else
-      close(fd);
+    close(sock);
 #endif
-      fprintf(stderr, "setnonblock\n");
-      fnet_free((struct fnet_t *)conn);
-      freeaddrinfo(addrs);
-      return NULL;
-    }
+    return;
+  }
 
-    conn->fds[conn->nfds] = fd;
-    conn->nfds++;
+  // Frees the path for the next process to wait for its own successor
+#if !defined(_WIN32) && !defined(_WIN64)
+  if (!getsockname(conn->fds[0], (struct sockaddr *)&addr, &addrlen)) unlink(addr.sun_path);
+  close(sock);
+#endif
 
-    if (fpfd) {
-      fpoll_add(fpfd, FPOLL_IN | FPOLL_HUP, fd, conn);
-    }
+  // Closing our copies leaves the sockets open in the next process
+  for ( c = connections ; c ; c = c->next ) {
+    if (!c->handed) continue;
+    c->handed = false;
+    if (c->wbuf.data) free(c->wbuf.data);
+    c->wbuf = (struct buf){};
+    fnet_close((struct fnet_t *)c);
+  }
+  fnet_close((struct fnet_t *)conn);
 
-    // Only need 1 connection
-    break;
+  if (options->onComplete) {
+    options->onComplete(&((struct fnet_ev){
+      .connection = NULL,
+      .type       = FNET_EVENT_HANDOVER,
+      .buffer     = NULL,
+      .udata      = options->udata,
+    }));
   }
+}
 
-  freeaddrinfo(addrs);
+// Shared memory connections, woken by their doorbell, the peer hanging up or the run queue
+FNET_RETURNCODE _fnet_dispatch_shm(struct fnet_internal_t *conn, FPOLL_STATUS ev) {
+  struct fnet_shm_t *shm    = conn->shm;
+  size_t            budget  = _fnet_budget(conn);
+  size_t            n       = 0;
 
-  // Could not connect, might be unreachable, might be something else
-  // We're not checking for the WHY here
-  if (conn->nfds != 1) {
-    fnet_free((struct fnet_t *)conn);
-    return NULL;
+  if (ev & FPOLL_IN) _fnet_shm_ack(shm);
+
+  // The peer may have made room
+  if (conn->wbuf.len && (_fnet_flush(conn) < 0)) _fnet_fail(conn, errno);
+  if (conn->ext.status & FNET_STATUS_CLOSED) return FNET_RETURNCODE_OK;
+
+  if (!conn->rpaused && !(conn->ext.status & FNET_STATUS_END)) {
+    conn->rbuf.len = 0;
+    n = _fnet_shm_read(shm, &(conn->rbuf), budget);
+  }
+  if (n) {
+    // Showed up while spinning, worth looking a bit longer next time
+    if (shm->idle && (shm->idle <= shm->spin) && (shm->spin < FNET_SHM_SPIN)) shm->spin <<= 1;
+    shm->idle  = 0;
+    conn->idle = 0;
+    _fnet_received(conn);
   }
 
-  conn->ext.status = FNET_STATUS_CONNECTED;
+  if (conn->ext.status & FNET_STATUS_CLOSED) {
+    // Nothing left to do
+  } else if (shm->broken) {
+    _fnet_fail(conn, EPROTO);
+  } else if ((n >= budget) && !conn->rpaused) {
+    // Cut off by the budget, the rest waits until everyone else had a turn
+    stats.requeued++;
+    _fnet_enqueue(conn, 0);
+  } else if (ev & (FPOLL_HUP | FNET_POLL_RDHUP | FNET_POLL_ERR)) {
+    // The peer is gone, nobody would read what we write anymore
+    _fnet_fail(conn, _fnet_shm_ended(shm) ? 0 : ECONNRESET);
+  } else if (conn->ext.status & FNET_STATUS_END) {
+    // Only woken for room to write from here on
+  } else if (_fnet_shm_ended(shm)) {
+    _fnet_eof(conn);
+  } else if (conn->rpaused) {
+    // Woken once the peer made room for what's queued
+  } else if (n || (shm->idle++ < shm->spin)) {
+    // Stay awake for a while after traffic, a busy peer doesn't need to ring
+    _fnet_enqueue(conn, 0);
+  } else {
+    // Spun for nothing, look for less long next time
+    if ((shm->idle == (shm->spin + 1)) && (shm->spin > 1)) shm->spin >>= 1;
+    if (!_fnet_shm_sleep(shm)) _fnet_enqueue(conn, 0);
+  }
 
-  if (conn->ext.onConnect) {
-    conn->ext.onConnect(&((struct fnet_ev){
-      .connection = (struct fnet_t *)conn,
-      .type       = FNET_EVENT_CONNECT,
-      .buffer     = NULL,
-      .udata      = conn->ext.udata,
-    }));
+  // Closed ones don't read anymore, and when short on memory buffers aren't kept around
+  if ((conn->ext.status & FNET_STATUS_CLOSED) || memtight) {
+    _fnet_release(conn);
+  } else {
+    _fnet_account(conn);
+  }
+  if (memtight && conn->wbuf.len && !(conn->ext.status & FNET_STATUS_CLOSED)) {
+    _fnet_readable(conn, false);
   }
 
-  return (struct fnet_t *)conn;
+  return FNET_RETURNCODE_OK;
 }
 
-FNET_RETURNCODE fnet_process(const struct fnet_t *connection) {
-  struct fnet_internal_t *conn = (struct fnet_internal_t *)connection;
+// Handles what the poll reported for the connection, ev is a mask of FPOLL_*
+FNET_RETURNCODE _fnet_dispatch(struct fnet_internal_t *conn, FPOLL_STATUS ev) {
   struct fnet_internal_t *nconn = NULL;
+  struct fnet_shm_t      *shm;
   int i;
   FNET_SOCKET nfd;
   struct sockaddr_storage addr;
   socklen_t addrlen = sizeof(addr);
-  struct buf *rbuf = NULL;
-
-  char *tmp_buf = NULL;
-  int   tmp_n   = 0;
-
-  // Checking arguments are given
-  if (!conn) {
-    fprintf(stderr, "fnet_process: connection argument is required\n");
-    return FNET_RETURNCODE_MISSING_ARGUMENT;
-  }
+  ssize_t n;
 
   // No processing to be done here
   /* printf("Status:"); */
@@ -436,53 +2026,104 @@ FNET_RETURNCODE fnet_process(const struct fnet_t *connection) {
   /*   return FNET_RETURNCODE_NOT_IMPLEMENTED; */
   /* } */
 
+  if (conn->greeting) {
+    _fnet_greeted(conn);
+    return FNET_RETURNCODE_OK;
+  }
+
   if (conn->ext.status & FNET_STATUS_CONNECTED) {
-    rbuf       = malloc(sizeof(struct buf));
-    tmp_buf    = malloc(BUFSIZ);
-    rbuf->data = malloc(BUFSIZ);
-    rbuf->cap  = BUFSIZ;
+    if (conn->shm) return _fnet_dispatch_shm(conn, ev);
+
+    // Broken, or hung up with nothing left to read, a recv would only tell us the same
+    // Backends without FPOLL_ERR may still report it as a bit we don't know
+    if ((ev & FNET_POLL_ERR) || ((ev & FPOLL_HUP) && !(ev & FPOLL_IN)) || !(ev & (FPOLL_IN | FPOLL_OUT | FPOLL_HUP))) {
+      _fnet_fail(conn, _fnet_sockerror(conn->fds[0]));
+      return FNET_RETURNCODE_OK;
+    }
+
+    if ((ev & FPOLL_OUT) && conn->wbuf.len && (_fnet_flush(conn) < 0)) {
+      _fnet_fail(conn, errno);
+      return FNET_RETURNCODE_OK;
+    }
+
+    // Waiting for the peer to read what we've sent, or it won't send anymore
+    if (!(ev & FPOLL_IN) || conn->rpaused) return FNET_RETURNCODE_OK;
+    if (conn->ext.status & (FNET_STATUS_END | FNET_STATUS_CLOSED)) return FNET_RETURNCODE_OK;
 
     for ( i = 0 ; i < conn->nfds ; i++ ) {
+      n = _fnet_recv(conn, conn->fds[i]);
 
-      rbuf->len = 0;
-      do {
-        tmp_n = recv(conn->fds[i], tmp_buf, BUFSIZ, 0);
-        buf_append(rbuf, tmp_buf, tmp_n);
-      } while(tmp_n == BUFSIZ);
+      /* printf("Received %d bytes\n", n); */
 
-      /* printf("Received %d bytes\n", rbuf->len); */
+      if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+        continue;
+      }
 
-      if (rbuf->len < 0) {
-        if (errno == EAGAIN) continue;
-        buf_clear(rbuf);
-        free(rbuf);
-        free(tmp_buf);
-        return FNET_RETURNCODE_ERRNO;
+      // An error we can't recover from
+      if (n < 0) {
+        _fnet_fail(conn, errno);
+        break;
       }
 
-      if (rbuf->len == 0) {
-        fnet_close((struct fnet_t *)conn);
+      // The peer is done sending
+      if (!n) {
+        _fnet_eof(conn);
         break;
       }
-      if (conn->ext.onData) {
-        conn->ext.onData(&((struct fnet_ev){
-          .connection = (struct fnet_t *)conn,
-          .type       = FNET_EVENT_DATA,
-          .buffer     = rbuf,
-          .udata      = conn->ext.udata,
-        }));
+      _fnet_received(conn);
+      conn->idle = 0;
+
+      if (conn->ext.status & (FNET_STATUS_END | FNET_STATUS_CLOSED)) break;
+
+      // Cut off by the budget, the rest waits until everyone else had a turn
+      if ((size_t)n >= _fnet_budget(conn)) {
+        if (!conn->rpaused) {
+          stats.requeued++;
+          _fnet_enqueue(conn, FPOLL_IN);
+        }
+        continue;
+      }
+
+      // Drained with the peer's FIN already seen, saves the recv that'd return 0
+      if (ev & FNET_POLL_RDHUP) {
+        _fnet_eof(conn);
+        break;
       }
     }
 
-    buf_clear(rbuf);
-    free(rbuf);
-    free(tmp_buf);
+    // Closed ones don't read anymore, and when short on memory buffers aren't kept around
+    if ((conn->ext.status & FNET_STATUS_CLOSED) || memtight) {
+      _fnet_release(conn);
+    } else {
+      _fnet_account(conn);
+    }
+    if (memtight && conn->wbuf.len && !(conn->ext.status & FNET_STATUS_CLOSED)) {
+      _fnet_readable(conn, false);
+    }
+
     return FNET_RETURNCODE_OK;
   }
 
   if (conn->ext.status & FNET_STATUS_LISTENING) {
+    if (conn->handover) {
+      _fnet_handover_serve(conn);
+      return FNET_RETURNCODE_OK;
+    }
+
     /* printf("Processing %d listening fds\n", conn->nfds); */
     for ( i = 0 ; i < conn->nfds ; i++ ) {
+
+      // Over a limit, either stop polling or drop what's in the backlog
+      if (!_fnet_admit(conn)) {
+        if (!(conn->flags & FNET_FLAG_SHED_RESET)) {
+          _fnet_pause(conn);
+          break;
+        }
+        nfd = accept(conn->fds[i], (struct sockaddr *)&addr, &addrlen);
+        if (nfd >= 0) _fnet_shed(conn, nfd);
+        continue;
+      }
+
       nfd = accept(conn->fds[i], (struct sockaddr *)&addr, &addrlen);
       /* printf("New sock: %d\n", nfd); */
 
@@ -497,44 +2138,46 @@ FNET_RETURNCODE fnet_process(const struct fnet_t *connection) {
           /* printf("No new connections\n"); */
           continue;
         }
-        // Indicate the errno is set
-        return FNET_RETURNCODE_ERRNO;
+        // Gone before we got to it, the next one may be fine
+        if ((errno == ECONNABORTED) || (errno == EINTR)) {
+          continue;
+        }
+        // Out of descriptors or memory, retrying right away would spin, the backlog waits
+        conn->backoff = _fnet_now() + FNET_ACCEPT_BACKOFF;
+        _fnet_pause(conn);
+        break;
       }
 
-      // Make this one non-blocking and stay alive
-      if (setnonblock(nfd) < 0) return FNET_RETURNCODE_ERROR;
-      if (setkeepalive(nfd) < 0) return FNET_RETURNCODE_ERROR;
-
-      // Create new fnet_t instance
-      // _init already tracks the connection
-      nconn = _fnet_init(&((struct fnet_options_t){
-        .proto     = conn->ext.proto,
-        .flags     = conn->flags & (~FNET_FLAG_RECONNECT),
-        .onListen  = NULL,
-        .onConnect = NULL,
-        .onData    = NULL,
-        .onTick    = NULL,
-        .onClose   = NULL,
-        .udata     = NULL,
-      }));
-
-      nconn->fds        = malloc(sizeof(FNET_SOCKET));
-      nconn->fds[0]     = nfd;
-      nconn->nfds       = 1;
-      nconn->ext.status = FNET_STATUS_CONNECTED | FNET_STATUS_ACCEPTED;
-
-      if (conn->ext.onConnect) {
-        conn->ext.onConnect(&((struct fnet_ev){
-          .connection = (struct fnet_t *)nconn,
-          .type       = FNET_EVENT_CONNECT,
-          .buffer     = NULL,
-          .udata      = conn->ext.udata,
-        }));
+      // Shared memory peers send their rings first, dropped when that fails
+      // Usually already there, otherwise the loop doesn't wait for them
+      shm = NULL;
+      if (conn->ext.proto == FNET_PROTO_SHM) {
+        if (!_fnet_shm_ready(nfd)) {
+          _fnet_greet(conn, nfd);
+          continue;
+        }
+        shm = _fnet_shm_accept(nfd);
+        if (!shm) continue;
+      } else {
+        // Make this one non-blocking and stay alive, one bad socket doesn't stop the listener
+        if ((setnonblock(nfd) < 0) || (setkeepalive(nfd) < 0)) {
+#if defined(_WIN32) || defined(_WIN64)
+          closesocket(nfd);
+#else
+          close(nfd);
+#endif
+          continue;
+        }
+        _fnet_sockopts(nfd);
+        if (conn->rcvlowat) {
+          setsockopt(nfd, SOL_SOCKET, SO_RCVLOWAT, (void*)&(conn->rcvlowat), sizeof(int));
+        }
       }
 
-      if (fpfd) {
-        fpoll_add(fpfd, FPOLL_IN | FPOLL_HUP, nfd, nconn);
-      }
+      nconn = _fnet_accepted(conn, nfd, shm);
+      if (!nconn) continue;
+      if (conn->rate) conn->tokens -= 1000;
+      _fnet_welcome(conn, nconn);
     }
 
     // TODO: handle client connection
@@ -544,6 +2187,68 @@ FNET_RETURNCODE fnet_process(const struct fnet_t *connection) {
   return FNET_RETURNCODE_OK;
 }
 
+// Gives every queued connection one turn, highest class first
+// Whoever gets queued again during the pass waits for the next one, after new events
+FNET_RETURNCODE _fnet_run() {
+  struct fnet_internal_t *conn;
+  FNET_RETURNCODE ret;
+  FPOLL_STATUS    ev;
+  size_t          n[3];
+  int             c;
+
+  for ( c = 0 ; c < 3 ; c++ ) n[c] = nrun[c];
+  for ( c = 0 ; c < 3 ; c++ ) {
+    for ( ; n[c] && runq[c] ; n[c]-- ) {
+      conn     = runq[c];
+      runq[c]  = conn->runnext;
+      if (!runq[c]) runtail[c] = NULL;
+      nrun[c]--;
+      ev           = conn->ready;
+      conn->ready  = 0;
+      conn->queued = false;
+      ret = _fnet_dispatch(conn, ev);
+      if (ret) return ret;
+    }
+  }
+  return FNET_RETURNCODE_OK;
+}
+
+FNET_RETURNCODE fnet_priority(const struct fnet_t *connection, FNET_PRIORITY priority) {
+  struct fnet_internal_t *conn = (struct fnet_internal_t *)connection;
+  FPOLL_STATUS ev;
+
+  // Checking arguments are given
+  if (!conn) {
+    fprintf(stderr, "fnet_priority: connection argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  if (priority > FNET_PRIORITY_BULK) {
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+
+  // Move along to the queue of the new class
+  if (!conn->queued) {
+    conn->priority = priority;
+    return FNET_RETURNCODE_OK;
+  }
+  ev = conn->ready;
+  _fnet_dequeue(conn);
+  conn->priority = priority;
+  _fnet_enqueue(conn, ev);
+  return FNET_RETURNCODE_OK;
+}
+
+FNET_RETURNCODE fnet_process(const struct fnet_t *connection) {
+  // Checking arguments are given
+  if (!connection) {
+    fprintf(stderr, "fnet_process: connection argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+
+  // Without a poll telling us what's ready, try everything
+  return _fnet_dispatch((struct fnet_internal_t *)connection, FPOLL_IN | FPOLL_OUT);
+}
+
 FNET_RETURNCODE fnet_write(const struct fnet_t *connection, struct buf *buf) {
   struct fnet_internal_t *conn = (struct fnet_internal_t *)connection;
 
@@ -563,8 +2268,28 @@ FNET_RETURNCODE fnet_write(const struct fnet_t *connection, struct buf *buf) {
     return FNET_RETURNCODE_UNPROCESSABLE;
   }
 
+  // Our side has been shut down
+  if (conn->shutwr) {
+    fprintf(stderr, "fnet_write: Writing after fnet_end is not possible\n");
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+
+  FNET_CAPTURE(SEND, conn, buf->data, buf->len);
+
+  // Still resolving, sent once connected
+  if (conn->ext.status & FNET_STATUS_CONNECTING) {
+    if (!buf_append(&(conn->wbuf), buf->data, buf->len)) {
+      fprintf(stderr, "fnet_write: %s\n", strerror(ENOMEM));
+      return FNET_RETURNCODE_ERRNO;
+    }
+    _fnet_account(conn);
+    return FNET_RETURNCODE_OK;
+  }
+
+  conn->idle = 0;
+
   // How would I do this?? :S
-  if (conn->nfds > 1) {
+  if ((conn->nfds > 1) && !conn->shm) {
     fprintf(stderr, "fnet_write: Only connections with 1 file descriptor supported\n");
     return FNET_RETURNCODE_NOT_IMPLEMENTED;
   }
@@ -573,32 +2298,116 @@ FNET_RETURNCODE fnet_write(const struct fnet_t *connection, struct buf *buf) {
     return FNET_RETURNCODE_NOT_IMPLEMENTED;
   }
 
-  int n = 0;
+  size_t  n = 0;
   ssize_t r;
-  while(n < buf->len) {
+
+  // Straight into the peer's ring, whatever doesn't fit waits for it to make room
+  if (conn->shm && !conn->wbuf.len) n = _fnet_shm_write(conn->shm, buf->data, buf->len);
+  if (conn->shm && conn->shm->broken) {
+    // Failed from the loop, not from inside the caller's write
+    _fnet_enqueue(conn, 0);
+    errno = EPROTO;
+    return FNET_RETURNCODE_ERRNO;
+  }
+
+  // Anything pending goes first, keeps the stream in order
+  while(!conn->shm && (!conn->wbuf.len) && (n < buf->len)) {
     r = send(conn->fds[0], &(buf->data[n]), buf->len - n, 0);
     // Handle errors
     if (r < 0) {
-      if (errno == EAGAIN) {
-        continue; // Try again
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        FNET_TRACE(SEND_EAGAIN, conn, 0);
+        break;
       }
       // We don't have a way to handle this error (yet)
       fprintf(stderr, "fnet_write: Unable to write to connection\n");
       return FNET_RETURNCODE_ERRNO;
     }
+    if ((size_t)r < (buf->len - n)) {
+      FNET_TRACE(SEND_PARTIAL, conn, r);
+    } else {
+      FNET_TRACE(SEND, conn, r);
+    }
     // Increment counter with amount of bytes written
     // Allows for a partial write to not corrupt the data stream
     n += r;
   }
 
+  // The rest is sent once the socket is writable again
+  if (n < buf->len) {
+    if (!buf_append(&(conn->wbuf), &(buf->data[n]), buf->len - n)) {
+      fprintf(stderr, "fnet_write: %s\n", strerror(ENOMEM));
+      return FNET_RETURNCODE_ERRNO;
+    }
+    _fnet_account(conn);
+    _fnet_arm(conn, true);
+  }
+
+  return FNET_RETURNCODE_OK;
+}
+
+// Shuts down sending once everything queued went out, the peer reads EOF
+FNET_RETURNCODE fnet_end(const struct fnet_t *connection) {
+  struct fnet_internal_t *conn = (struct fnet_internal_t *)connection;
+
+  // Checking arguments are given
+  if (!conn) {
+    fprintf(stderr, "fnet_end: connection argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  if (!(conn->ext.status & (FNET_STATUS_CONNECTING | FNET_STATUS_CONNECTED)) || (conn->ext.status & FNET_STATUS_CLOSED)) {
+    fprintf(stderr, "fnet_end: Only open connections can be ended\n");
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+  if (conn->shutwr) return FNET_RETURNCODE_OK;
+  conn->shutwr = true;
+
+  // Done once connected or drained
+  if (conn->wbuf.len || !conn->nfds) return FNET_RETURNCODE_OK;
+
+  _fnet_shutwr(conn);
+  if (conn->ext.status & FNET_STATUS_END) fnet_close((struct fnet_t *)conn);
   return FNET_RETURNCODE_OK;
 }
 
+// Moves the sockets, rings and the unsent part of the queue to a connection of its own
+// It only waits for room to write, and is closed once drained, broken or out of time
+void _fnet_linger(struct fnet_internal_t *conn, size_t sent) {
+  struct fnet_internal_t *rest = _fnet_init(&((struct fnet_options_t){ .proto = conn->ext.proto }));
+  int i;
+
+  for ( i = 0 ; i < conn->nfds ; i++ ) fpoll_del(fpfd, ~0, conn->fds[i]);
+  rest->fds  = conn->fds;
+  rest->nfds = conn->nfds;
+  rest->shm  = conn->shm;
+  conn->fds  = NULL;
+  conn->nfds = 0;
+  conn->shm  = NULL;
+
+  memmove(conn->wbuf.data, conn->wbuf.data + sent, conn->wbuf.len - sent);
+  rest->wbuf      = conn->wbuf;
+  rest->wbuf.len -= sent;
+  conn->wbuf      = (struct buf){};
+  _fnet_account(conn);
+  _fnet_account(rest);
+
+  // Not reading anymore, a peer that stopped sending doesn't end it early
+  rest->ext.status = FNET_STATUS_CONNECTED | FNET_STATUS_END;
+  rest->owned      = true;
+  rest->rpaused    = true;
+  rest->wantout    = true;
+  rest->linger     = FNET_LINGER;
+  _fnet_poll(rest);
+}
+
 FNET_RETURNCODE fnet_close(const struct fnet_t *connection) {
   /* printf("Internal fnet_close\n"); */
   struct fnet_internal_t *conn = (struct fnet_internal_t *)connection;
+  struct fnet_internal_t *child;
   FNET_CALLBACK(cb) = NULL;
   int i;
+  size_t  n;
+  ssize_t r;
 
   // Checking arguments are given
   if (!conn) {
@@ -606,6 +2415,35 @@ FNET_RETURNCODE fnet_close(const struct fnet_t *connection) {
     return FNET_RETURNCODE_MISSING_ARGUMENT;
   }
 
+  // Nobody's waiting for the address anymore
+  if (conn->resolving) {
+    fnet_resolve_cancel(conn->resolving);
+    conn->resolving = NULL;
+  }
+
+  // Don't lose what's queued when closing, without holding up the loop for a slow peer
+  n = 0;
+  if (conn->wbuf.len && conn->shm) {
+    n = _fnet_shm_write(conn->shm, conn->wbuf.data, conn->wbuf.len);
+  } else if (conn->wbuf.len && (conn->nfds == 1)) {
+    for ( ; n < conn->wbuf.len ; n += r ) {
+      r = send(conn->fds[0], &(conn->wbuf.data[n]), conn->wbuf.len - n, 0);
+      if (r <= 0) break;
+    }
+  }
+  if ((n < conn->wbuf.len) && (conn->shm ? !conn->shm->broken : (conn->nfds == 1)) && !conn->linger && fpfd && runners && (conn->ext.status & FNET_STATUS_CONNECTED)) {
+    _fnet_linger(conn, n);
+  }
+  if (conn->shm) {
+    _fnet_shm_free(conn->shm);
+    conn->shm = NULL;
+  }
+  if (conn->wbuf.data) free(conn->wbuf.data);
+  conn->wbuf    = (struct buf){};
+  conn->wantout = false;
+  conn->rpaused = false;
+  _fnet_account(conn);
+
   if (conn->nfds) {
     for ( i = 0 ; i < conn->nfds ; i++ ) {
       if (fpfd) {
@@ -622,18 +2460,36 @@ FNET_RETURNCODE fnet_close(const struct fnet_t *connection) {
     conn->fds = NULL;
   }
 
+  // Release admission slots
+  if (conn->ext.status & FNET_STATUS_ACCEPTED) {
+    accepted--;
+    if (conn->parent) conn->parent->nconns--;
+    conn->parent = NULL;
+  }
+  if (conn->paused) {
+    conn->paused = false;
+    paused--;
+  }
+
+  // Children may outlive their listener
+  if (conn->nconns) {
+    for ( child = connections ; child ; child = child->next ) {
+      if (child->parent == conn) child->parent = NULL;
+    }
+    conn->nconns = 0;
+  }
+
+  if (!(conn->ext.status & FNET_STATUS_CLOSED)) {
+    FNET_TRACE(CLOSE, conn, 0);
+    FNET_CAPTURE(CLOSE, conn, NULL, 0);
+    conn->idle = 0;
+  }
   conn->ext.status = FNET_STATUS_CLOSED;
 
   if (conn->ext.onClose) {
     cb = conn->ext.onClose;
     conn->ext.onClose = NULL;
-
-    cb(&((struct fnet_ev){
-      .connection = (struct fnet_t *)conn,
-      .type       = FNET_EVENT_CLOSE,
-      .buffer     = NULL,
-      .udata      = conn->ext.udata,
-    }));
+    _fnet_emit(conn, cb, FNET_EVENT_CLOSE);
   }
 
   return FNET_RETURNCODE_OK;
@@ -654,32 +2510,168 @@ FNET_RETURNCODE fnet_free(struct fnet_t *connection) {
   if (conn == connections) connections = conn->next;
 
   fnet_close((struct fnet_t *)conn);
+  _fnet_dequeue(conn);
 
   if (conn->fds) free(conn->fds);
+  if (conn->handover) free(conn->handover);
+  if (conn->rbuf.data) free(conn->rbuf.data);
+  conn->rbuf = (struct buf){};
+
+  _fnet_account(conn);
+  memstats.connections -= sizeof(struct fnet_internal_t);
+  memstats.charged     -= conn->charged;
+  _fnet_account(NULL);
 
   free(conn);
 
   return FNET_RETURNCODE_OK;
 }
 
+// Waits for the next process at path, see fnet_takeover
+FNET_RETURNCODE fnet_handover(const char *path, const struct fnet_handover_t *options) {
+#if defined(_WIN32) || defined(_WIN64)
+  return FNET_RETURNCODE_NOT_IMPLEMENTED;
+#else
+  struct fnet_internal_t *conn;
+  struct sockaddr_un     addr = { .sun_family = AF_UNIX };
+  FNET_SOCKET            fd;
+
+  // Checking arguments are given
+  if (!path) {
+    fprintf(stderr, "fnet_handover: path argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  if (!options) {
+    fprintf(stderr, "fnet_handover: options argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "fnet_handover: path too long\n");
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+  strcpy(addr.sun_path, path);
+
+  // Left behind by a process that exited without handing over
+  unlink(path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    fprintf(stderr, "fnet_handover: %s\n", strerror(errno));
+    return FNET_RETURNCODE_ERRNO;
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 1) || (setnonblock(fd) < 0)) {
+    fprintf(stderr, "fnet_handover: %s\n", strerror(errno));
+    close(fd);
+    return FNET_RETURNCODE_ERRNO;
+  }
+
+  // Looks like a listener to the loop, freed once closed
+  conn = _fnet_init(&((struct fnet_options_t){ .proto = FNET_PROTO_TCP }));
+  conn->handover = malloc(sizeof(struct fnet_handover_t));
+  conn->fds      = malloc(sizeof(FNET_SOCKET));
+  if (!conn->handover || !conn->fds) {
+    fprintf(stderr, "fnet_handover: %s\n", strerror(ENOMEM));
+    close(fd);
+    fnet_free((struct fnet_t *)conn);
+    return FNET_RETURNCODE_ERRNO;
+  }
+  *(conn->handover) = *options;
+  conn->fds[0]      = fd;
+  conn->nfds        = 1;
+  conn->ext.status  = FNET_STATUS_LISTENING;
+  conn->owned       = true;
+
+  if (fpfd) {
+    fpoll_add(fpfd, FPOLL_IN | FPOLL_HUP, fd, conn);
+  }
+  return FNET_RETURNCODE_OK;
+#endif
+}
+
+// Receives the sockets of the process waiting at path, fnet_listen picks them up
+FNET_RETURNCODE fnet_takeover(const char *path) {
+#if defined(_WIN32) || defined(_WIN64)
+  return FNET_RETURNCODE_NOT_IMPLEMENTED;
+#else
+  struct sockaddr_un      addr = { .sun_family = AF_UNIX };
+  struct fnet_inherited_t entry, *grown;
+  char                    magic[8];
+  char                    done = 1;
+  FNET_SOCKET             sock;
+
+  // Checking arguments are given
+  if (!path) {
+    fprintf(stderr, "fnet_takeover: path argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "fnet_takeover: path too long\n");
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+  strcpy(addr.sun_path, path);
+
+  // Nobody waiting is the normal case on a first start, not worth a message
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) return FNET_RETURNCODE_ERRNO;
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+    close(sock);
+    return FNET_RETURNCODE_ERRNO;
+  }
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (void*)&((struct timeval){ .tv_sec = FNET_HANDOVER_TIMEOUT }), sizeof(struct timeval));
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void*)&((struct timeval){ .tv_sec = FNET_HANDOVER_TIMEOUT }), sizeof(struct timeval));
+
+  if (_fnet_handover_read(sock, magic, sizeof(magic))) goto fail;
+  if (memcmp(magic, FNET_HANDOVER_MAGIC, sizeof(magic))) {
+    errno = EPROTO;
+    goto fail;
+  }
+
+  for (;;) {
+    if (_fnet_handover_recv(sock, &(entry.rec), &(entry.fd), &(entry.wbuf), &(entry.rbuf))) goto fail;
+    if (entry.rec.type == FNET_HANDOVER_END) break;
+    entry.claimed = NULL;
+    grown = realloc(inherited, (ninherited + 1) * sizeof(struct fnet_inherited_t));
+    if (!grown || (entry.fd < 0)) {
+      if (entry.fd >= 0) close(entry.fd);
+      if (entry.wbuf.data) free(entry.wbuf.data);
+      if (entry.rbuf.data) free(entry.rbuf.data);
+      if (grown) inherited = grown;
+      errno = grown ? EPROTO : ENOMEM;
+      goto fail;
+    }
+    inherited = grown;
+    inherited[ninherited++] = entry;
+  }
+
+  // Confirm, then wait for the other side to let go of the path
+  if (_fnet_handover_write(sock, &done, 1)) goto fail;
+  _fnet_handover_read(sock, &done, 1);
+  close(sock);
+  return FNET_RETURNCODE_OK;
+
+fail:
+  fprintf(stderr, "fnet_takeover: %s\n", strerror(errno));
+  close(sock);
+  _fnet_inherit_release();
+  return FNET_RETURNCODE_ERRNO;
+#endif
+}
+
 FNET_RETURNCODE fnet_tick(int doProcess) {
   struct fnet_internal_t *conn = connections;
   FNET_RETURNCODE ret;
+  int n = 0;
+  FNET_TRACE(TICK_ENTER, (struct fnet_internal_t *)NULL, doProcess);
   while(conn) {
+    n++;
     if (doProcess) {
       ret = fnet_process((struct fnet_t *)conn);
       if (ret < 0) return ret;
     }
-    if (conn->ext.onTick) {
-      conn->ext.onTick(&((struct fnet_ev){
-        .connection = (struct fnet_t *)conn,
-        .type       = FNET_EVENT_TICK,
-        .buffer     = NULL,
-        .udata      = conn->ext.udata,
-      }));
-    }
+    _fnet_emit(conn, conn->ext.onTick, FNET_EVENT_TICK);
     conn = conn->next;
   }
+  FNET_TRACE(TICK_EXIT, (struct fnet_internal_t *)NULL, n);
   return FNET_RETURNCODE_OK;
 }
 
@@ -691,6 +2683,10 @@ FNET_RETURNCODE fnet_main() {
   FNET_RETURNCODE ret;
   int64_t         ttime = _fnet_now();
   int64_t         tdiff = 0;
+  int64_t         twait;
+  int64_t         tnext;
+  int64_t         tspin = 0; // Last time the poll returned events, in us
+  int64_t         tnow;
   int             ev_count;
   int             i;
 
@@ -700,13 +2696,43 @@ FNET_RETURNCODE fnet_main() {
 
   runners++;
 
-  struct fpoll_ev events[8];
+  // Listeners had their chance to claim what was taken over
+  _fnet_inherit_release();
+
+  struct fpoll_ev events[FNET_POLL_EVENTS];
 
   while(runners) {
 
     // Do the actual processing
     if (fpfd) {
-      ev_count = fpoll_wait(fpfd, events, 8, tdiff);
+      _fnet_pressure();
+      twait = _fnet_admission();
+      if ((twait < 0) || (twait > tdiff)) twait = tdiff;
+      tnext = _fnet_timers();
+      if ((tnext >= 0) && (tnext < twait)) twait = tnext;
+
+      // Busy-polling, keep checking without sleeping for a while after activity
+      tnow = busypoll.spin ? _fnet_now_us() : 0;
+      if (busypoll.spin && ((tnow - tspin) < busypoll.spin)) twait = 0;
+
+      // Connections left with work only need a look for new events
+      if (nrun[0] || nrun[1] || nrun[2]) twait = 0;
+
+      FNET_TRACE(WAIT, (struct fnet_internal_t *)NULL, twait);
+      ev_count = fpoll_wait(fpfd, events, FNET_POLL_EVENTS, twait);
+      FNET_TRACE(WAKEUP, (struct fnet_internal_t *)NULL, ev_count);
+
+      if (busypoll.spin) {
+        if (ev_count > 0) tspin = _fnet_now_us();
+        if (twait) {
+          stats.sleeps++;
+          stats.sleepTime += (ev_count > 0 ? tspin : _fnet_now_us()) - tnow;
+        } else {
+          stats.spins++;
+          stats.spinTime += (ev_count > 0 ? tspin : _fnet_now_us()) - tnow;
+          if (ev_count > 0) stats.spinHits++;
+        }
+      }
       /* if (ev_count) { */
       /*   printf("New events: %d\n", ev_count); */
       /* } */
@@ -716,9 +2742,10 @@ FNET_RETURNCODE fnet_main() {
         /* printf((events[i].ev & FPOLL_OUT) ? " OUT" : ""); */
         /* printf((events[i].ev & FPOLL_HUP) ? " HUP" : ""); */
         /* printf("\n"); */
-        ret = fnet_process((struct fnet_t *)events[i].udata);
-        if (ret) return ret;
+        _fnet_enqueue((struct fnet_internal_t *)events[i].udata, events[i].ev);
       }
+      ret = _fnet_run();
+      if (ret) return ret;
     } else {
       fnet_tick(1);
     }
@@ -729,6 +2756,7 @@ FNET_RETURNCODE fnet_main() {
       ttime += 1000;
       tdiff += 1000;
       fnet_tick(0);
+      _fnet_sweep();
     }
 
     // Sleep if no epoll
@@ -751,6 +2779,8 @@ FNET_RETURNCODE fnet_main() {
 FNET_RETURNCODE fnet_shutdown() {
   runners = 0;
   while(connections) fnet_free((struct fnet_t *)connections);
+  while(ntimers) fnet_timer_cancel(timers[0]);
+  _fnet_inherit_release();
 #if defined(_WIN32) || defined(_WIN64)
   WSACleanup();
 #endif
@@ -1,15 +1,27 @@
 #ifndef __INCLUDE_FINWO_FNET_H__
 #define __INCLUDE_FINWO_FNET_H__
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "tidwall/buf.h"
 
 #define FNET_FLAG            uint8_t
 #define FNET_FLAG_RECONNECT  1
+#define FNET_FLAG_SHED_RESET 2 // Accept-and-reset instead of pausing a listener when shedding
+#define FNET_FLAG_FIONREAD   4 // Query pending bytes and read them in a single call
+#define FNET_FLAG_REUSEPORT  8 // Share the port with other listeners, prefer the one on the receiving cpu
+#define FNET_FLAG_CPU_STEER 16 // Steer connections to the n-th listener of the port by receiving cpu
 
 #define FNET_PROTOCOL  uint8_t
 #define FNET_PROTO_TCP 0
+#define FNET_PROTO_SHM 1 // Same-host peers over shared memory rings, address is a name and port is ignored, linux-only
+
+#define FNET_PRIORITY        uint8_t
+#define FNET_PRIORITY_NORMAL 0
+#define FNET_PRIORITY_HIGH   1 // Serviced first in every pass, for control traffic
+#define FNET_PRIORITY_BULK   2 // Serviced last in every pass, for transfers
 
 #define FNET_RETURNCODE                  int
 #define FNET_RETURNCODE_OK               0
@@ -29,6 +41,7 @@
 #define FNET_STATUS_ACCEPTED       8 // Whether the connection is an accepted one
 #define FNET_STATUS_ERROR         16
 #define FNET_STATUS_CLOSED        32
+#define FNET_STATUS_END           64 // Peer shut down its sending side, writing still works
 
 #define FNET_EVENT         int
 #define FNET_EVENT_LISTEN  1
@@ -36,6 +49,12 @@
 #define FNET_EVENT_DATA    3
 #define FNET_EVENT_TICK    4
 #define FNET_EVENT_CLOSE   5
+#define FNET_EVENT_SHED    6 // Listener paused or an accepted connection was shed
+#define FNET_EVENT_RESUME  7 // Listener accepting again
+#define FNET_EVENT_DRAIN   8 // Everything written has been handed to the kernel
+#define FNET_EVENT_TIMER   9
+#define FNET_EVENT_END    10 // Peer shut down its sending side
+#define FNET_EVENT_HANDOVER 11 // Connection moving to the next process, or all of them moved
 
 #define FNET_CALLBACK(NAME) void (*(NAME))(struct fnet_ev *event)
 
@@ -49,11 +68,16 @@ struct fnet_ev {
 struct fnet_t {
   FNET_PROTOCOL proto;
   FNET_STATUS   status;
+  int           cpu;   // Cpu the connection's packets arrived on, -1 if unknown
+  int           error; // errno that closed the connection, 0 when closed cleanly
   FNET_CALLBACK(onListen);
   FNET_CALLBACK(onConnect);
   FNET_CALLBACK(onData);
   FNET_CALLBACK(onTick);
   FNET_CALLBACK(onClose);
+  FNET_CALLBACK(onShed);
+  FNET_CALLBACK(onDrain);
+  FNET_CALLBACK(onEnd);
   void *udata;
 };
 
@@ -65,17 +89,117 @@ struct fnet_options_t {
   FNET_CALLBACK(onData);
   FNET_CALLBACK(onTick);
   FNET_CALLBACK(onClose);
+  FNET_CALLBACK(onShed);
+  FNET_CALLBACK(onDrain);
+  FNET_CALLBACK(onEnd); // Keeps the connection open for writing when the peer stops sending, closed otherwise
   void *udata;
+
+  // Listener admission control, 0 = unlimited
+  int         maxConnections; // Concurrent accepted connections
+  int         acceptRate;     // Accepts per second
+  int         acceptBurst;    // Token bucket size, defaults to acceptRate
+  struct buf *shedResponse;   // Sent before closing a shed connection (FNET_FLAG_SHED_RESET)
+
+  int         rcvLowat;       // SO_RCVLOWAT, don't wake up before this many bytes are pending
+
+  FNET_PRIORITY priority;     // Accepted connections inherit the listener's
+
+  size_t      shmSize;        // FNET_PROTO_SHM ring bytes per direction, chosen by the connecting side, 0 = 1MiB
+};
+
+struct fnet_busypoll_t {
+  int64_t spin;           // Keep polling without sleeping for this many us after activity, 0 = off
+  int     busyPoll;       // SO_BUSY_POLL in us for new sockets, 0 = off
+  bool    preferBusyPoll; // SO_PREFER_BUSY_POLL for new sockets
+};
+
+struct fnet_fairness_t {
+  size_t budget;     // Bytes read from a connection per pass before moving on, 0 = FNET_RECV_MAX
+  size_t bulkBudget; // Same for FNET_PRIORITY_BULK connections, 0 = budget
+};
+
+struct fnet_stats_t {
+  uint64_t spins;     // Zero-timeout polls while busy-polling
+  uint64_t spinHits;  // Zero-timeout polls that returned events
+  uint64_t spinTime;  // us spent in zero-timeout polls
+  uint64_t sleeps;    // Blocking polls while busy-polling
+  uint64_t sleepTime; // us spent in blocking polls
+
+  uint64_t remoteAccepts; // Connections accepted on a pinned loop that arrived on another cpu
+
+  uint64_t requeued;      // Reads cut off by the budget, continued in a later pass
+};
+
+struct fnet_handover_t {
+  bool connections;          // Hand over accepted connections too, otherwise they're left here to drain
+  FNET_CALLBACK(onHandover); // Per connection, append what was received but not processed to buffer, or set buffer to NULL to keep it here
+  FNET_CALLBACK(onComplete); // Listeners and connections live in the next process now
+  void *udata;               // Given to onComplete
+};
+
+struct fnet_memory_t {
+  size_t  softLimit;   // Bytes, above it stop accepting, drop receive buffers and pause reads of backed-up connections, 0 = off
+  size_t  hardLimit;   // Bytes, above it shed the accepted connections using the most memory, 0 = off
+  int64_t idleRelease; // Release the buffers of connections idle for this many ms, 0 = off
+};
+
+struct fnet_memstats_t {
+  uint64_t connections; // Bytes in connection objects, closed ones included until freed
+  uint64_t recvBuffers; // Bytes allocated for receiving
+  uint64_t sendBuffers; // Bytes queued or allocated for sending
+  uint64_t charged;     // Bytes reported through fnet_charge
+  uint64_t total;
+  uint64_t peak;
+
+  uint64_t released;    // Buffer bytes released from idle connections or under pressure
+  uint64_t readPauses;  // Connections that stopped being read from until their queue drained
+  uint64_t shed;        // Connections closed over the hard limit
+  uint64_t reaped;      // Closed accepted connections freed
 };
 
 struct fnet_t * fnet_listen(const char *address, uint16_t port, const struct fnet_options_t *options);
 struct fnet_t * fnet_connect(const char *address, uint16_t port, const struct fnet_options_t *options);
+struct fnet_t * fnet_adopt(int fd, const struct fnet_options_t *options);
 
 FNET_RETURNCODE fnet_process(const struct fnet_t *connection);
+FNET_RETURNCODE fnet_rcvlowat(const struct fnet_t *connection, int bytes);
+FNET_RETURNCODE fnet_priority(const struct fnet_t *connection, FNET_PRIORITY priority);
+FNET_RETURNCODE fnet_readable(const struct fnet_t *connection, bool readable);
 FNET_RETURNCODE fnet_write(const struct fnet_t *connection, struct buf *buf);
+size_t          fnet_pending(const struct fnet_t *connection);
+FNET_RETURNCODE fnet_end(const struct fnet_t *connection);
 FNET_RETURNCODE fnet_close(const struct fnet_t *connection);
+
+// Connections from fnet_connect, fnet_adopt and fnet_listen are the caller's to free
+// Accepted connections are fnet's: freed a tick or two after closing, or right after
+// onClose when shed over the hard memory limit. Don't touch them once onClose returned
 FNET_RETURNCODE fnet_free(struct fnet_t *connection);
 
+struct fnet_timer_t * fnet_timer(int64_t ms, FNET_CALLBACK(cb), void *udata);
+FNET_RETURNCODE       fnet_timer_cancel(struct fnet_timer_t *timer);
+
+FNET_RETURNCODE fnet_max_connections(int max);
+FNET_RETURNCODE fnet_busypoll(const struct fnet_busypoll_t *options);
+FNET_RETURNCODE fnet_fairness(const struct fnet_fairness_t *options);
+FNET_RETURNCODE fnet_pin(int cpu);
+FNET_RETURNCODE fnet_stats(struct fnet_stats_t *out);
+
+FNET_RETURNCODE fnet_memory(const struct fnet_memory_t *options);
+FNET_RETURNCODE fnet_memstats(struct fnet_memstats_t *out);
+size_t          fnet_footprint(const struct fnet_t *connection);
+FNET_RETURNCODE fnet_charge(const struct fnet_t *connection, int64_t bytes);
+
+FNET_RETURNCODE fnet_trace_start(size_t nevents);
+FNET_RETURNCODE fnet_trace_stop();
+FNET_RETURNCODE fnet_trace_dump(const char *filename);
+
+FNET_RETURNCODE fnet_capture_start(const char *filename, size_t maxbytes);
+FNET_RETURNCODE fnet_capture_stop();
+
+// Once the next process connects, the loop is blocked until everything is handed over
+FNET_RETURNCODE fnet_handover(const char *path, const struct fnet_handover_t *options);
+FNET_RETURNCODE fnet_takeover(const char *path);
+
 void            fnet_thread();
 FNET_RETURNCODE fnet_main();
 FNET_RETURNCODE fnet_shutdown();
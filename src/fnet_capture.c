@@ -0,0 +1,143 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "fnet.h"
+#include "fnet_capture.h"
+#include "fnet_trace.h"
+
+#ifndef FNET_CAPTURE_SIZE
+#define FNET_CAPTURE_SIZE 268435456
+#endif
+
+char   *fnet_capture_map  = NULL;
+size_t fnet_capture_size  = 0;
+int    fnet_capture_fd    = -1;
+
+#if defined(_WIN32) || defined(_WIN64)
+
+void _fnet_capture(uint32_t type, uint64_t conn, const char *data, size_t len) {
+}
+FNET_RETURNCODE fnet_capture_start(const char *filename, size_t maxbytes) {
+  return FNET_RETURNCODE_NOT_IMPLEMENTED;
+}
+FNET_RETURNCODE fnet_capture_stop() {
+  return FNET_RETURNCODE_OK;
+}
+
+#else
+
+void _fnet_capture(uint32_t type, uint64_t conn, const char *data, size_t len) {
+  struct fnet_capture_header *header = (struct fnet_capture_header *)fnet_capture_map;
+  struct fnet_capture_rec    *rec;
+  size_t need = sizeof(struct fnet_capture_rec) + ((len + 7) & ~((size_t)7));
+
+  if ((len > UINT32_MAX) || ((sizeof(struct fnet_capture_header) + header->length + need) > fnet_capture_size)) {
+    header->dropped++;
+    return;
+  }
+
+  rec       = (struct fnet_capture_rec *)(fnet_capture_map + sizeof(struct fnet_capture_header) + header->length);
+  rec->ts   = _fnet_trace_now();
+  rec->conn = conn;
+  rec->type = type;
+  rec->len  = len;
+  if (len) memcpy(rec + 1, data, len);
+
+  // Only counted once complete, whatever reads the file sees whole records
+  header->length += need;
+}
+
+// Reserves the blocks for the whole file, a sparse one would raise SIGBUS on a full disk
+int _fnet_capture_reserve(int fd, size_t size) {
+#if defined(__APPLE__)
+  fstore_t store = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)size, 0 };
+  if (fcntl(fd, F_PREALLOCATE, &store) < 0) return errno;
+  return ftruncate(fd, size) ? errno : 0;
+#else
+  return posix_fallocate(fd, 0, size);
+#endif
+}
+
+// Reserves and maps maxbytes of the file up-front, fails when the disk can't hold them
+FNET_RETURNCODE fnet_capture_start(const char *filename, size_t maxbytes) {
+  struct fnet_capture_header *header;
+  int                        error;
+
+  if (!filename) {
+    fprintf(stderr, "fnet_capture_start: filename argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  if (fnet_capture_map) {
+    return FNET_RETURNCODE_ALREADY_ACTIVE;
+  }
+  if (!maxbytes) maxbytes = FNET_CAPTURE_SIZE;
+  if (maxbytes <= sizeof(struct fnet_capture_header)) {
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+
+  fnet_capture_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fnet_capture_fd < 0) {
+    fprintf(stderr, "fnet_capture_start: %s\n", strerror(errno));
+    return FNET_RETURNCODE_ERRNO;
+  }
+  error = _fnet_capture_reserve(fnet_capture_fd, maxbytes);
+  if (error) {
+    fprintf(stderr, "fnet_capture_start: %s\n", strerror(error));
+    // Give back what was reserved before running out, nothing to do when that fails too
+    if (ftruncate(fnet_capture_fd, 0)) {}
+    close(fnet_capture_fd);
+    fnet_capture_fd = -1;
+    errno           = error;
+    return FNET_RETURNCODE_ERRNO;
+  }
+
+  fnet_capture_map = mmap(NULL, maxbytes, PROT_READ | PROT_WRITE, MAP_SHARED, fnet_capture_fd, 0);
+  if (fnet_capture_map == MAP_FAILED) {
+    fprintf(stderr, "fnet_capture_start: %s\n", strerror(errno));
+    fnet_capture_map = NULL;
+    close(fnet_capture_fd);
+    fnet_capture_fd = -1;
+    return FNET_RETURNCODE_ERRNO;
+  }
+  fnet_capture_size = maxbytes;
+#if defined(MADV_SEQUENTIAL)
+  madvise(fnet_capture_map, maxbytes, MADV_SEQUENTIAL);
+#endif
+
+  header = (struct fnet_capture_header *)fnet_capture_map;
+  memcpy(header->magic, FNET_CAPTURE_MAGIC, sizeof(header->magic));
+  header->recsize = sizeof(struct fnet_capture_rec);
+  header->length  = 0;
+  header->dropped = 0;
+  return FNET_RETURNCODE_OK;
+}
+
+// Unmaps the capture and cuts the file down to what was written
+FNET_RETURNCODE fnet_capture_stop() {
+  struct fnet_capture_header *header = (struct fnet_capture_header *)fnet_capture_map;
+  FNET_RETURNCODE ret = FNET_RETURNCODE_OK;
+  size_t length;
+
+  if (!fnet_capture_map) return FNET_RETURNCODE_OK;
+
+  length = sizeof(struct fnet_capture_header) + header->length;
+  munmap(fnet_capture_map, fnet_capture_size);
+  if (ftruncate(fnet_capture_fd, length)) ret = FNET_RETURNCODE_ERRNO;
+  if (close(fnet_capture_fd)) ret = FNET_RETURNCODE_ERRNO;
+
+  fnet_capture_map  = NULL;
+  fnet_capture_size = 0;
+  fnet_capture_fd   = -1;
+  return ret;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef __INCLUDE_FINWO_FNET_CAPTURE_H__
+#define __INCLUDE_FINWO_FNET_CAPTURE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Traffic capture format, shared with util/fnet_replay
+//
+// A capture is a header followed by header.length bytes of records. Every
+// record is directly followed by its data, padded to a multiple of 8 bytes.
+// Timestamps are in nanoseconds on a monotonic clock.
+
+#define FNET_CAPTURE_MAGIC "FNETCAP1"
+
+#define FNET_CAPTURE_ACCEPT  1 // Accepted by a listener
+#define FNET_CAPTURE_CONNECT 2 // Connected through fnet_connect
+#define FNET_CAPTURE_RECV    3 // data = bytes received from the peer
+#define FNET_CAPTURE_SEND    4 // data = bytes written by the application
+#define FNET_CAPTURE_CLOSE   5
+
+struct fnet_capture_header {
+  char     magic[8];
+  uint32_t recsize;  // Size of a record without its data
+  uint32_t reserved;
+  uint64_t length;   // Bytes of records after the header, only grows once they're complete
+  uint64_t dropped;  // Records that didn't fit anymore
+};
+
+struct fnet_capture_rec {
+  uint64_t ts;
+  uint64_t conn;
+  uint32_t type;
+  uint32_t len;
+};
+
+#ifndef FNET_CAPTURE_FORMAT_ONLY
+
+// A single branch when not capturing
+#ifdef FNET_NO_CAPTURE
+#define FNET_CAPTURE(TYPE, CONN, DATA, LEN)
+#else
+#define FNET_CAPTURE(TYPE, CONN, DATA, LEN) do {                             \
+    if (fnet_capture_map) {                                                  \
+      _fnet_capture(FNET_CAPTURE_##TYPE, (CONN)->id, (DATA), (LEN));         \
+    }                                                                        \
+  } while(0)
+#endif
+
+extern char *fnet_capture_map;
+
+void _fnet_capture(uint32_t type, uint64_t conn, const char *data, size_t len);
+
+#endif // FNET_CAPTURE_FORMAT_ONLY
+
+#endif // __INCLUDE_FINWO_FNET_CAPTURE_H__
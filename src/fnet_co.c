@@ -0,0 +1,349 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+#include "tidwall/buf.h"
+
+#include "fnet.h"
+#include "fnet_co.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+
+FNET_RETURNCODE fnet_co_spawn(struct fnet_t *connection, FNET_CO_FN(fn), void *udata) {
+  return FNET_RETURNCODE_NOT_IMPLEMENTED;
+}
+FNET_RETURNCODE fnet_co_stacksize(size_t size) {
+  return FNET_RETURNCODE_NOT_IMPLEMENTED;
+}
+struct buf * fnet_co_read(struct fnet_t *connection, size_t n) {
+  return NULL;
+}
+FNET_RETURNCODE fnet_co_write(struct fnet_t *connection, struct buf *buf) {
+  return FNET_RETURNCODE_NOT_IMPLEMENTED;
+}
+FNET_RETURNCODE fnet_co_sleep(int64_t ms) {
+  return FNET_RETURNCODE_NOT_IMPLEMENTED;
+}
+
+#else
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+
+#define FNET_CO_WAIT_NONE  0
+#define FNET_CO_WAIT_READ  1
+#define FNET_CO_WAIT_WRITE 2
+#define FNET_CO_WAIT_SLEEP 3
+
+struct fnet_co_stack {
+  struct fnet_co_stack *next; // Free-list, only valid while pooled
+  size_t               size;
+};
+
+struct fnet_co_t {
+  ucontext_t           ctx;
+  ucontext_t           caller;
+  struct fnet_co_stack *stack;
+  struct fnet_t        *conn;
+  FNET_CO_FN(fn);
+  void                 *udata;
+  struct buf           in;   // Received, not yet read
+  struct buf           out;  // Handed out by the last read
+  size_t               want;
+  int                  wait;
+  int64_t              charged; // Reported to fnet through fnet_charge
+  bool                 held;    // Connection not read from until the coroutine catches up
+  bool                 closed;
+  bool                 ended; // Peer stopped sending, writing still works
+  bool                 done;
+};
+
+struct fnet_co_t     *current   = NULL;
+struct fnet_co_stack *stacks    = NULL;
+size_t               stacksize  = FNET_CO_STACKSIZE;
+size_t               pagesize   = 0;
+
+// Stacks get a PROT_NONE guard page below them, an overflow faults instead of corrupting the heap
+// Memory is only committed once touched, and handed back when pooled, except for the top page
+struct fnet_co_stack * _fnet_co_stack_get() {
+  struct fnet_co_stack *stack;
+  char *mem;
+
+  if (!pagesize) pagesize = sysconf(_SC_PAGESIZE);
+
+  if (stacks && (stacks->size == stacksize)) {
+    stack  = stacks;
+    stacks = stack->next;
+    return stack;
+  }
+
+  mem = mmap(NULL, stacksize + pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (mem == MAP_FAILED) return NULL;
+  if (mprotect(mem, pagesize, PROT_NONE)) {
+    munmap(mem, stacksize + pagesize);
+    return NULL;
+  }
+
+  // Bookkeeping lives at the top of the usable area
+  stack       = (struct fnet_co_stack *)(mem + pagesize + stacksize - sizeof(struct fnet_co_stack));
+  stack->size = stacksize;
+  stack->next = NULL;
+  return stack;
+}
+
+char * _fnet_co_stack_base(struct fnet_co_stack *stack) {
+  return ((char *)stack) + sizeof(struct fnet_co_stack) - stack->size;
+}
+
+void _fnet_co_stack_put(struct fnet_co_stack *stack) {
+  if (stack->size != stacksize) {
+    munmap(_fnet_co_stack_base(stack) - pagesize, stack->size + pagesize);
+    return;
+  }
+#ifdef MADV_DONTNEED
+  // The page holding the bookkeeping has to survive
+  if (stack->size > pagesize) madvise(_fnet_co_stack_base(stack), stack->size - pagesize, MADV_DONTNEED);
+#endif
+  stack->next = stacks;
+  stacks      = stack;
+}
+
+void _fnet_co_entry() {
+  struct fnet_co_t *co = current;
+  co->fn(co->conn, co->udata);
+  co->done = true;
+  swapcontext(&(co->ctx), &(co->caller));
+}
+
+// Keeps what a coroutine costs its connection in fnet's memory accounting up to date
+void _fnet_co_charge(struct fnet_co_t *co) {
+  int64_t now = 0;
+  if (!co->closed) now = sizeof(struct fnet_co_t) + co->stack->size + co->in.cap + co->out.cap;
+  if (now == co->charged) return;
+  fnet_charge(co->conn, now - co->charged);
+  co->charged = now;
+}
+
+// Stops reading from the connection while the coroutine has plenty to catch up on
+void _fnet_co_hold(struct fnet_co_t *co, bool held) {
+  if ((co->held == held) || co->closed) return;
+  co->held = held;
+  fnet_readable(co->conn, !held);
+}
+
+void _fnet_co_free(struct fnet_co_t *co) {
+  // Closed connections are freed by fnet, don't touch it anymore
+  if (!co->closed) {
+    co->conn->onData  = NULL;
+    co->conn->onDrain = NULL;
+    co->conn->onEnd   = NULL;
+    co->conn->onClose = NULL;
+    co->conn->udata   = NULL;
+    _fnet_co_hold(co, false);
+    co->closed = true;
+    _fnet_co_charge(co);
+    fnet_close(co->conn);
+  }
+  _fnet_co_stack_put(co->stack);
+  if (co->in.data) free(co->in.data);
+  if (co->out.data) free(co->out.data);
+  free(co);
+}
+
+void _fnet_co_resume(struct fnet_co_t *co) {
+  struct fnet_co_t *prev = current;
+  if (co == current) return;
+  co->wait = FNET_CO_WAIT_NONE;
+  current  = co;
+  swapcontext(&(co->caller), &(co->ctx));
+  current  = prev;
+  if (co->done) _fnet_co_free(co);
+}
+
+void _fnet_co_yield(int wait) {
+  struct fnet_co_t *co = current;
+  co->wait = wait;
+  swapcontext(&(co->ctx), &(co->caller));
+}
+
+void _fnet_co_onData(struct fnet_ev *ev) {
+  struct fnet_co_t *co = ev->udata;
+  buf_append(&(co->in), ev->buffer->data, ev->buffer->len);
+  _fnet_co_charge(co);
+  if ((co->wait == FNET_CO_WAIT_READ) && (co->in.len >= co->want)) {
+    _fnet_co_resume(co);
+    return;
+  }
+
+  // Not being read right now, let the peer wait instead of buffering without end
+  if ((co->wait != FNET_CO_WAIT_READ) && (co->in.len >= FNET_CO_READAHEAD)) {
+    _fnet_co_hold(co, true);
+  }
+}
+
+void _fnet_co_onDrain(struct fnet_ev *ev) {
+  struct fnet_co_t *co = ev->udata;
+  if (co->wait == FNET_CO_WAIT_WRITE) {
+    _fnet_co_resume(co);
+  }
+}
+
+void _fnet_co_onEnd(struct fnet_ev *ev) {
+  struct fnet_co_t *co = ev->udata;
+  co->ended = true;
+  if (co->wait == FNET_CO_WAIT_READ) {
+    _fnet_co_resume(co);
+  }
+}
+
+void _fnet_co_onClose(struct fnet_ev *ev) {
+  struct fnet_co_t *co = ev->udata;
+  co->closed = true;
+  _fnet_co_charge(co);
+  if ((co->wait == FNET_CO_WAIT_READ) || (co->wait == FNET_CO_WAIT_WRITE)) {
+    _fnet_co_resume(co);
+  }
+}
+
+void _fnet_co_onTimer(struct fnet_ev *ev) {
+  struct fnet_co_t *co = ev->udata;
+  _fnet_co_resume(co);
+}
+
+FNET_RETURNCODE fnet_co_stacksize(size_t size) {
+  if (size < 4096) {
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+  if (!pagesize) pagesize = sysconf(_SC_PAGESIZE);
+  stacksize = ((size + pagesize - 1) / pagesize) * pagesize;
+  return FNET_RETURNCODE_OK;
+}
+
+FNET_RETURNCODE fnet_co_spawn(struct fnet_t *connection, FNET_CO_FN(fn), void *udata) {
+  struct fnet_co_t *co;
+
+  // Checking arguments are given
+  if (!connection) {
+    fprintf(stderr, "fnet_co_spawn: connection argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  if (!fn) {
+    fprintf(stderr, "fnet_co_spawn: fn argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  if (!(connection->status & FNET_STATUS_CONNECTED)) {
+    fprintf(stderr, "fnet_co_spawn: connection is not connected\n");
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+
+  co = calloc(1, sizeof(struct fnet_co_t));
+  if (!co) return FNET_RETURNCODE_ERRNO;
+
+  co->stack = _fnet_co_stack_get();
+  if (!co->stack) {
+    free(co);
+    return FNET_RETURNCODE_ERRNO;
+  }
+
+  co->conn  = connection;
+  co->fn    = fn;
+  co->udata = udata;
+
+  getcontext(&(co->ctx));
+  co->ctx.uc_stack.ss_sp   = _fnet_co_stack_base(co->stack);
+  co->ctx.uc_stack.ss_size = co->stack->size - sizeof(struct fnet_co_stack);
+  co->ctx.uc_link          = NULL;
+  makecontext(&(co->ctx), _fnet_co_entry, 0);
+
+  connection->onData  = _fnet_co_onData;
+  connection->onDrain = _fnet_co_onDrain;
+  connection->onEnd   = _fnet_co_onEnd;
+  connection->onClose = _fnet_co_onClose;
+  connection->udata   = co;
+  _fnet_co_charge(co);
+
+  // Runs until the first time it has to wait
+  _fnet_co_resume(co);
+  return FNET_RETURNCODE_OK;
+}
+
+// Waits for n bytes, or anything when n is 0
+// Returns less on close or once the peer stopped sending, NULL once nothing is left
+struct buf * fnet_co_read(struct fnet_t *connection, size_t n) {
+  struct fnet_co_t *co = current;
+
+  if (!co || (co->conn != connection)) {
+    fprintf(stderr, "fnet_co_read: not called from the connection's coroutine\n");
+    return NULL;
+  }
+
+  co->want = n ? n : 1;
+  while((co->in.len < co->want) && !co->closed && !co->ended) {
+    _fnet_co_hold(co, false);
+    _fnet_co_yield(FNET_CO_WAIT_READ);
+  }
+  if (!co->in.len) return NULL;
+
+  if (!n || (n > co->in.len)) n = co->in.len;
+  co->out.len = 0;
+  if (!buf_append(&(co->out), co->in.data, n)) return NULL;
+  memmove(co->in.data, co->in.data + n, co->in.len - n);
+  co->in.len -= n;
+  if (co->in.len < FNET_CO_READAHEAD) _fnet_co_hold(co, false);
+  _fnet_co_charge(co);
+  return &(co->out);
+}
+
+// Returns once everything has been handed to the kernel
+FNET_RETURNCODE fnet_co_write(struct fnet_t *connection, struct buf *buf) {
+  struct fnet_co_t *co = current;
+  FNET_RETURNCODE  ret;
+
+  if (!co || (co->conn != connection)) {
+    fprintf(stderr, "fnet_co_write: not called from the connection's coroutine\n");
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+  if (co->closed) {
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+
+  ret = fnet_write(connection, buf);
+  if (ret < 0) return ret;
+
+  while(fnet_pending(connection) && !co->closed) {
+    _fnet_co_yield(FNET_CO_WAIT_WRITE);
+  }
+  return co->closed ? FNET_RETURNCODE_UNPROCESSABLE : FNET_RETURNCODE_OK;
+}
+
+FNET_RETURNCODE fnet_co_sleep(int64_t ms) {
+  struct fnet_co_t *co = current;
+
+  if (!co) {
+    fprintf(stderr, "fnet_co_sleep: not called from a coroutine\n");
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+  if (!fnet_timer(ms, _fnet_co_onTimer, co)) {
+    return FNET_RETURNCODE_ERRNO;
+  }
+
+  _fnet_co_yield(FNET_CO_WAIT_SLEEP);
+  return FNET_RETURNCODE_OK;
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef __INCLUDE_FINWO_FNET_CO_H__
+#define __INCLUDE_FINWO_FNET_CO_H__
+
+// Stackful coroutines on top of the fnet loop
+//
+// A coroutine owns its connection's onData, onDrain, onEnd, onClose and udata, and
+// reads, writes and sleeps as if it were blocking. Only call the fnet_co_*
+// functions from within the coroutine they belong to.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fnet.h"
+
+#ifndef FNET_CO_STACKSIZE
+#define FNET_CO_STACKSIZE 65536
+#endif
+
+// Bytes received ahead of the coroutine reading them before the connection stops being read from
+#ifndef FNET_CO_READAHEAD
+#define FNET_CO_READAHEAD 262144
+#endif
+
+#define FNET_CO_FN(NAME) void (*(NAME))(struct fnet_t *connection, void *udata)
+
+FNET_RETURNCODE fnet_co_spawn(struct fnet_t *connection, FNET_CO_FN(fn), void *udata);
+FNET_RETURNCODE fnet_co_stacksize(size_t size);
+
+struct buf *    fnet_co_read(struct fnet_t *connection, size_t n);
+FNET_RETURNCODE fnet_co_write(struct fnet_t *connection, struct buf *buf);
+FNET_RETURNCODE fnet_co_sleep(int64_t ms);
+
+#endif // __INCLUDE_FINWO_FNET_CO_H__
@@ -0,0 +1,437 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <winsock2.h>
+#include <Ws2tcpip.h>
+#else
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "tidwall/buf.h"
+
+#include "fnet.h"
+#include "fnet_dns.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define FNET_DNS_BUCKETS 64
+
+// From fnet.c
+extern int runners;
+int64_t _fnet_now();
+
+struct fnet_resolve_t {
+  struct fnet_resolve_t *next;
+  FNET_DNS_CALLBACK(cb); // NULL once cancelled
+  void                  *udata;
+};
+
+struct fnet_dns_query {
+  struct fnet_dns_query *next;    // Todo or done queue, shared with the resolver threads
+  struct fnet_dns_query *inext;   // In-flight list, loop only
+  char                  *host;
+  uint16_t              port;
+  struct addrinfo       *addrs;
+  int                   error;
+  struct fnet_resolve_t *waiters;
+};
+
+struct fnet_dns_entry {
+  struct fnet_dns_entry *next;    // Bucket chain
+  struct fnet_dns_entry *newer;
+  struct fnet_dns_entry *older;
+  uint32_t              hash;
+  char                  *host;
+  uint16_t              port;
+  struct addrinfo       *addrs;
+  int                   error;
+  int64_t               expires;
+};
+
+struct fnet_dns_options_t dnsopts     = {};
+struct fnet_dns_stats_t   dnsstats    = {};
+struct fnet_dns_entry     *dnscache[FNET_DNS_BUCKETS] = {};
+struct fnet_dns_entry     *dnsnewest  = NULL;
+struct fnet_dns_entry     *dnsoldest  = NULL;
+size_t                    dnsentries  = 0;
+struct fnet_dns_query     *dnsinflight = NULL;
+
+uint32_t _fnet_dns_hash(const char *host, uint16_t port) {
+  uint32_t hash = 2166136261u;
+  for ( ; *host ; host++ ) {
+    hash = (hash ^ (uint8_t)(*host)) * 16777619u;
+  }
+  hash = (hash ^ (port & 0xFF)) * 16777619u;
+  hash = (hash ^ (port >> 8)) * 16777619u;
+  return hash;
+}
+
+void _fnet_dns_drop(struct fnet_dns_entry *entry) {
+  struct fnet_dns_entry **ptr = &(dnscache[entry->hash % FNET_DNS_BUCKETS]);
+  while(*ptr != entry) ptr = &((*ptr)->next);
+  *ptr = entry->next;
+
+  if (entry->newer) entry->newer->older = entry->older;
+  if (entry->older) entry->older->newer = entry->newer;
+  if (dnsnewest == entry) dnsnewest = entry->older;
+  if (dnsoldest == entry) dnsoldest = entry->newer;
+  dnsentries--;
+
+  if (entry->addrs) freeaddrinfo(entry->addrs);
+  free(entry->host);
+  free(entry);
+}
+
+struct fnet_dns_entry * _fnet_dns_lookup(const char *host, uint16_t port) {
+  uint32_t              hash  = _fnet_dns_hash(host, port);
+  struct fnet_dns_entry *entry = dnscache[hash % FNET_DNS_BUCKETS];
+
+  for ( ; entry ; entry = entry->next ) {
+    if ((entry->hash == hash) && (entry->port == port) && !strcmp(entry->host, host)) break;
+  }
+  if (!entry) return NULL;
+
+  if (entry->expires <= _fnet_now()) {
+    dnsstats.expired++;
+    _fnet_dns_drop(entry);
+    return NULL;
+  }
+
+  // Move to the front of the lru list
+  if (dnsnewest != entry) {
+    if (entry->older) entry->older->newer = entry->newer;
+    else              dnsoldest           = entry->newer;
+    entry->newer->older = entry->older;
+    entry->older        = dnsnewest;
+    entry->newer        = NULL;
+    dnsnewest->newer    = entry;
+    dnsnewest           = entry;
+  }
+  return entry;
+}
+
+// Takes ownership of addrs when cached, returns NULL when not
+struct fnet_dns_entry * _fnet_dns_store(const char *host, uint16_t port, struct addrinfo *addrs, int error) {
+  struct fnet_dns_entry *entry;
+  int64_t ttl        = error ? dnsopts.negativeTtl : dnsopts.ttl;
+  size_t  maxentries = dnsopts.maxEntries ? dnsopts.maxEntries : 256;
+
+  if (!ttl) ttl = error ? 5000 : 60000;
+  if (ttl < 0) return NULL;
+
+  // Local trouble, says nothing about the name
+#if defined(EAI_SYSTEM)
+  if (error == EAI_SYSTEM) return NULL;
+#endif
+  if (error == EAI_MEMORY) return NULL;
+
+  entry = _fnet_dns_lookup(host, port);
+  if (entry) _fnet_dns_drop(entry);
+  while(dnsentries >= maxentries) {
+    dnsstats.evicted++;
+    _fnet_dns_drop(dnsoldest);
+  }
+
+  entry = calloc(1, sizeof(struct fnet_dns_entry));
+  if (!entry) return NULL;
+  entry->host = strdup(host);
+  if (!entry->host) {
+    free(entry);
+    return NULL;
+  }
+
+  entry->hash    = _fnet_dns_hash(host, port);
+  entry->port    = port;
+  entry->addrs   = addrs;
+  entry->error   = error;
+  entry->expires = _fnet_now() + ttl;
+
+  entry->next = dnscache[entry->hash % FNET_DNS_BUCKETS];
+  dnscache[entry->hash % FNET_DNS_BUCKETS] = entry;
+  entry->older = dnsnewest;
+  if (dnsnewest) dnsnewest->newer = entry;
+  dnsnewest = entry;
+  if (!dnsoldest) dnsoldest = entry;
+  dnsentries++;
+  return entry;
+}
+
+void _fnet_dns_hints(struct addrinfo *hints) {
+  memset(hints, 0, sizeof(struct addrinfo));
+  hints->ai_family   = AF_UNSPEC;
+  hints->ai_socktype = SOCK_STREAM;
+  hints->ai_protocol = IPPROTO_TCP;
+}
+
+struct fnet_resolve_t * _fnet_dns_wait(struct fnet_dns_query *query, FNET_DNS_CALLBACK(cb), void *udata) {
+  struct fnet_resolve_t *handle = calloc(1, sizeof(struct fnet_resolve_t));
+  if (!handle) return NULL;
+  handle->cb     = cb;
+  handle->udata  = udata;
+  handle->next   = query->waiters;
+  query->waiters = handle;
+  return handle;
+}
+
+// Caches the answer and hands it to everyone waiting for it
+void _fnet_dns_complete(struct fnet_dns_query *query) {
+  struct fnet_dns_query **ptr = &dnsinflight;
+  struct fnet_resolve_t *handle;
+  struct fnet_dns_entry *entry;
+
+  while(*ptr && (*ptr != query)) ptr = &((*ptr)->inext);
+  if (*ptr) *ptr = query->inext;
+
+  entry = _fnet_dns_store(query->host, query->port, query->addrs, query->error);
+  while((handle = query->waiters)) {
+    query->waiters = handle->next;
+    if (handle->cb) handle->cb(query->addrs, query->error, handle->udata);
+    free(handle);
+  }
+
+  if (!entry && query->addrs) freeaddrinfo(query->addrs);
+  free(query->host);
+  free(query);
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+
+// No resolver threads, lookups block the loop
+FNET_RETURNCODE _fnet_dns_start(struct fnet_dns_query *query) {
+  return FNET_RETURNCODE_NOT_IMPLEMENTED;
+}
+
+#else
+
+pthread_mutex_t       dnslock    = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t        dnscond    = PTHREAD_COND_INITIALIZER;
+struct fnet_dns_query *dnstodo   = NULL; // Oldest first
+struct fnet_dns_query *dnstail   = NULL;
+struct fnet_dns_query *dnsdone   = NULL; // Newest first
+int                   dnswake    = -1;   // Resolver side of the doorbell
+int                   dnsthreads = 0;
+struct fnet_t         *dnsbell   = NULL;
+
+void * _fnet_dns_worker(void *arg) {
+  struct fnet_dns_query *query;
+  struct addrinfo       hints;
+  char                  port[6];
+
+  _fnet_dns_hints(&hints);
+
+  for(;;) {
+    pthread_mutex_lock(&dnslock);
+    while(!dnstodo) pthread_cond_wait(&dnscond, &dnslock);
+    query   = dnstodo;
+    dnstodo = query->next;
+    if (!dnstodo) dnstail = NULL;
+    pthread_mutex_unlock(&dnslock);
+
+    snprintf(port, sizeof(port), "%d", query->port);
+    query->error = getaddrinfo(query->host, port, &hints, &(query->addrs));
+    if (query->error) query->addrs = NULL;
+
+    // Only ring when the loop might be asleep, it takes everything that's done at once
+    pthread_mutex_lock(&dnslock);
+    query->next = dnsdone;
+    dnsdone     = query;
+    if (!query->next && (dnswake >= 0)) send(dnswake, "", 1, MSG_NOSIGNAL);
+    pthread_mutex_unlock(&dnslock);
+  }
+
+  return NULL;
+}
+
+void _fnet_dns_onData(struct fnet_ev *ev) {
+  struct fnet_dns_query *query, *next, *list = NULL;
+
+  pthread_mutex_lock(&dnslock);
+  query   = dnsdone;
+  dnsdone = NULL;
+  pthread_mutex_unlock(&dnslock);
+
+  // Oldest first
+  for ( ; query ; query = next ) {
+    next        = query->next;
+    query->next = list;
+    list        = query;
+  }
+  for ( query = list ; query ; query = next ) {
+    next = query->next;
+    _fnet_dns_complete(query);
+  }
+}
+
+void _fnet_dns_onClose(struct fnet_ev *ev) {
+  dnsbell = NULL;
+  pthread_mutex_lock(&dnslock);
+  close(dnswake);
+  dnswake = -1;
+  pthread_mutex_unlock(&dnslock);
+}
+
+// Hands the query to a resolver thread, starting them and the doorbell they ring when needed
+FNET_RETURNCODE _fnet_dns_start(struct fnet_dns_query *query) {
+  int       fds[2];
+  int       threads = dnsopts.threads ? dnsopts.threads : 2;
+  pthread_t thread;
+
+  if (!dnsbell) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+      return FNET_RETURNCODE_ERRNO;
+    }
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+    dnsbell = fnet_adopt(fds[0], &((struct fnet_options_t){
+      .proto   = FNET_PROTO_TCP,
+      .onData  = _fnet_dns_onData,
+      .onClose = _fnet_dns_onClose,
+    }));
+    if (!dnsbell) {
+      close(fds[0]);
+      close(fds[1]);
+      return FNET_RETURNCODE_ERROR;
+    }
+    pthread_mutex_lock(&dnslock);
+    dnswake = fds[1];
+    if (dnsdone) send(dnswake, "", 1, MSG_NOSIGNAL);
+    pthread_mutex_unlock(&dnslock);
+  }
+
+  while(dnsthreads < threads) {
+    if (pthread_create(&thread, NULL, _fnet_dns_worker, NULL)) break;
+    pthread_detach(thread);
+    dnsthreads++;
+  }
+  if (!dnsthreads) {
+    return FNET_RETURNCODE_ERRNO;
+  }
+
+  pthread_mutex_lock(&dnslock);
+  if (dnstail) dnstail->next = query;
+  else         dnstodo       = query;
+  dnstail = query;
+  pthread_cond_signal(&dnscond);
+  pthread_mutex_unlock(&dnslock);
+  return FNET_RETURNCODE_OK;
+}
+
+#endif
+
+struct fnet_resolve_t * fnet_resolve(const char *host, uint16_t port, FNET_DNS_CALLBACK(cb), void *udata) {
+  struct addrinfo       hints, *addrs;
+  struct fnet_dns_entry *entry;
+  struct fnet_dns_query *query;
+  struct fnet_resolve_t *handle;
+  char                  portstr[6];
+  int                   error;
+
+  // Checking arguments are given
+  if (!host) {
+    fprintf(stderr, "fnet_resolve: host argument is required\n");
+    return NULL;
+  }
+  if (!cb) {
+    fprintf(stderr, "fnet_resolve: cb argument is required\n");
+    return NULL;
+  }
+
+  _fnet_dns_hints(&hints);
+  snprintf(portstr, sizeof(portstr), "%d", port);
+
+  // Literal addresses don't need a resolver
+  hints.ai_flags = AI_NUMERICHOST;
+  if (!getaddrinfo(host, portstr, &hints, &addrs)) {
+    cb(addrs, 0, udata);
+    freeaddrinfo(addrs);
+    return NULL;
+  }
+  hints.ai_flags = 0;
+
+  entry = _fnet_dns_lookup(host, port);
+  if (entry) {
+    dnsstats.hits++;
+    cb(entry->addrs, entry->error, udata);
+    return NULL;
+  }
+
+  // Someone's already asking
+  for ( query = dnsinflight ; query ; query = query->inext ) {
+    if ((query->port == port) && !strcmp(query->host, host)) break;
+  }
+  if (query && (handle = _fnet_dns_wait(query, cb, udata))) {
+    dnsstats.joined++;
+    return handle;
+  }
+
+  dnsstats.misses++;
+
+  // Off the loop when it's running, blocking is fine before it does
+  if (runners && (query = calloc(1, sizeof(struct fnet_dns_query)))) {
+    query->host = strdup(host);
+    query->port = port;
+    handle      = _fnet_dns_wait(query, cb, udata);
+    if (query->host && handle && (_fnet_dns_start(query) == FNET_RETURNCODE_OK)) {
+      query->inext = dnsinflight;
+      dnsinflight  = query;
+      return handle;
+    }
+    if (handle) free(handle);
+    if (query->host) free(query->host);
+    free(query);
+  }
+
+  error = getaddrinfo(host, portstr, &hints, &addrs);
+  if (error) addrs = NULL;
+  entry = _fnet_dns_store(host, port, addrs, error);
+  cb(addrs, error, udata);
+  if (!entry && addrs) freeaddrinfo(addrs);
+  return NULL;
+}
+
+// The callback won't be called anymore, the lookup itself still completes and is cached
+FNET_RETURNCODE fnet_resolve_cancel(struct fnet_resolve_t *handle) {
+  if (!handle) {
+    fprintf(stderr, "fnet_resolve_cancel: handle argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  handle->cb = NULL;
+  return FNET_RETURNCODE_OK;
+}
+
+FNET_RETURNCODE fnet_dns(const struct fnet_dns_options_t *options) {
+  if (!options) {
+    fprintf(stderr, "fnet_dns: options argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  if ((options->threads < 0) || (options->ttl < -1) || (options->negativeTtl < -1)) {
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+  dnsopts = *options;
+  return FNET_RETURNCODE_OK;
+}
+
+// Don't call from within a resolve callback, the addresses handed to it may come from the cache
+FNET_RETURNCODE fnet_dns_flush() {
+  while(dnsoldest) _fnet_dns_drop(dnsoldest);
+  return FNET_RETURNCODE_OK;
+}
+
+FNET_RETURNCODE fnet_dns_stats(struct fnet_dns_stats_t *out) {
+  if (!out) {
+    fprintf(stderr, "fnet_dns_stats: out argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  *out = dnsstats;
+  return FNET_RETURNCODE_OK;
+}
@@ -0,0 +1,45 @@
+#ifndef __INCLUDE_FINWO_FNET_DNS_H__
+#define __INCLUDE_FINWO_FNET_DNS_H__
+
+// Name resolution for fnet_connect and fnet_listen
+//
+// While fnet_main runs, lookups happen on resolver threads and complete from
+// within the loop. Results are cached by host and port, failures included.
+// getaddrinfo doesn't expose record TTLs, cached results expire after the
+// configured ttl instead.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fnet.h"
+
+struct addrinfo;
+
+// Error is 0 or an EAI_* code, addrs is only valid during the call
+#define FNET_DNS_CALLBACK(NAME) void (*(NAME))(const struct addrinfo *addrs, int error, void *udata)
+
+struct fnet_dns_options_t {
+  int     threads;     // Resolver threads, 0 = 2
+  int64_t ttl;         // ms a result is cached, 0 = 60000, -1 = don't cache
+  int64_t negativeTtl; // ms a failure is cached, 0 = 5000, -1 = don't cache
+  size_t  maxEntries;  // Cached names, least recently used are dropped first, 0 = 256
+};
+
+struct fnet_dns_stats_t {
+  uint64_t hits;     // Answered from the cache
+  uint64_t misses;   // Sent to a resolver thread or resolved in place
+  uint64_t joined;   // Attached to a lookup already in flight
+  uint64_t expired;  // Cached entries found past their ttl
+  uint64_t evicted;  // Cached entries dropped to stay under maxEntries
+};
+
+// Calls cb before returning when the answer is known or the loop isn't running, returning NULL
+// Otherwise returns a handle and calls cb from within fnet_main
+struct fnet_resolve_t * fnet_resolve(const char *host, uint16_t port, FNET_DNS_CALLBACK(cb), void *udata);
+FNET_RETURNCODE         fnet_resolve_cancel(struct fnet_resolve_t *handle);
+
+FNET_RETURNCODE fnet_dns(const struct fnet_dns_options_t *options);
+FNET_RETURNCODE fnet_dns_flush();
+FNET_RETURNCODE fnet_dns_stats(struct fnet_dns_stats_t *out);
+
+#endif // __INCLUDE_FINWO_FNET_DNS_H__
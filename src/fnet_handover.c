@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "fnet_handover.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+
+int _fnet_handover_send(int sock, const struct fnet_handover_rec *rec, int fd, const char *wdata, const char *rdata) {
+  errno = ENOSYS;
+  return -1;
+}
+int _fnet_handover_recv(int sock, struct fnet_handover_rec *rec, int *fd, struct buf *wbuf, struct buf *rbuf) {
+  errno = ENOSYS;
+  return -1;
+}
+int _fnet_handover_write(int sock, const void *data, size_t len) {
+  errno = ENOSYS;
+  return -1;
+}
+int _fnet_handover_read(int sock, void *data, size_t len) {
+  errno = ENOSYS;
+  return -1;
+}
+
+#else
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+int _fnet_handover_write(int sock, const void *data, size_t len) {
+  ssize_t r;
+  size_t  n;
+
+  for ( n = 0 ; n < len ; n += r ) {
+    r = send(sock, (const char *)data + n, len - n, MSG_NOSIGNAL);
+    if ((r < 0) && (errno == EINTR)) {
+      r = 0;
+      continue;
+    }
+    if (r <= 0) return -1;
+  }
+  return 0;
+}
+
+int _fnet_handover_read(int sock, void *data, size_t len) {
+  ssize_t r;
+  size_t  n;
+
+  for ( n = 0 ; n < len ; n += r ) {
+    r = recv(sock, (char *)data + n, len - n, 0);
+    if ((r < 0) && (errno == EINTR)) {
+      r = 0;
+      continue;
+    }
+    if (!r) errno = ECONNRESET;
+    if (r <= 0) return -1;
+  }
+  return 0;
+}
+
+int _fnet_handover_send(int sock, const struct fnet_handover_rec *rec, int fd, const char *wdata, const char *rdata) {
+  union {
+    struct cmsghdr hdr;
+    char           buf[CMSG_SPACE(sizeof(int))];
+  } cmsg = {};
+  struct iovec  iov = { .iov_base = (void *)rec, .iov_len = sizeof(*rec) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  ssize_t r;
+
+  // The socket travels with the record's first byte
+  if (fd >= 0) {
+    msg.msg_control     = cmsg.buf;
+    msg.msg_controllen  = sizeof(cmsg.buf);
+    cmsg.hdr.cmsg_level = SOL_SOCKET;
+    cmsg.hdr.cmsg_type  = SCM_RIGHTS;
+    cmsg.hdr.cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(&cmsg.hdr), &fd, sizeof(int));
+  }
+  do {
+    r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while((r < 0) && (errno == EINTR));
+  if (r < 0) return -1;
+  if (((size_t)r < sizeof(*rec)) && _fnet_handover_write(sock, (const char *)rec + r, sizeof(*rec) - r)) return -1;
+
+  if (rec->wlen && _fnet_handover_write(sock, wdata, rec->wlen)) return -1;
+  if (rec->rlen && _fnet_handover_write(sock, rdata, rec->rlen)) return -1;
+  return 0;
+}
+
+int _fnet_handover_recv(int sock, struct fnet_handover_rec *rec, int *fd, struct buf *wbuf, struct buf *rbuf) {
+  union {
+    struct cmsghdr hdr;
+    char           buf[CMSG_SPACE(sizeof(int))];
+  } cmsg = {};
+  struct iovec   iov = { .iov_base = rec, .iov_len = sizeof(*rec) };
+  struct msghdr  msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cmsg.buf, .msg_controllen = sizeof(cmsg.buf) };
+  struct cmsghdr *hdr;
+  ssize_t r;
+
+  *fd   = -1;
+  *wbuf = (struct buf){};
+  *rbuf = (struct buf){};
+  do {
+    r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while((r < 0) && (errno == EINTR));
+  if (!r) errno = ECONNRESET;
+  if (r <= 0) return -1;
+  hdr = CMSG_FIRSTHDR(&msg);
+  if (hdr && (hdr->cmsg_level == SOL_SOCKET) && (hdr->cmsg_type == SCM_RIGHTS) && (hdr->cmsg_len == CMSG_LEN(sizeof(int)))) {
+    memcpy(fd, CMSG_DATA(hdr), sizeof(int));
+  }
+  if (((size_t)r < sizeof(*rec)) && _fnet_handover_read(sock, (char *)rec + r, sizeof(*rec) - r)) goto fail;
+
+  if (rec->wlen) {
+    wbuf->data = malloc(rec->wlen);
+    if (!wbuf->data) goto fail;
+    wbuf->cap = wbuf->len = rec->wlen;
+    if (_fnet_handover_read(sock, wbuf->data, rec->wlen)) goto fail;
+  }
+  if (rec->rlen) {
+    rbuf->data = malloc(rec->rlen);
+    if (!rbuf->data) goto fail;
+    rbuf->cap = rbuf->len = rec->rlen;
+    if (_fnet_handover_read(sock, rbuf->data, rec->rlen)) goto fail;
+  }
+  return 0;
+
+fail:
+  if (*fd >= 0) close(*fd);
+  *fd = -1;
+  if (wbuf->data) free(wbuf->data);
+  if (rbuf->data) free(rbuf->data);
+  *wbuf = (struct buf){};
+  *rbuf = (struct buf){};
+  return -1;
+}
+
+#endif
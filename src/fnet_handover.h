@@ -0,0 +1,43 @@
+#ifndef __INCLUDE_FINWO_FNET_HANDOVER_H__
+#define __INCLUDE_FINWO_FNET_HANDOVER_H__
+
+// Wire format between fnet_handover and fnet_takeover
+//
+// The stream starts with the magic, followed by records. Every record carries
+// its socket as SCM_RIGHTS, a connection's record is directly followed by
+// wlen bytes still to be sent to its peer and rlen bytes received from it that
+// the application didn't process yet. Once the END record is read, the taking
+// process answers with a single byte and waits for the other side to hang up.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tidwall/buf.h"
+
+#define FNET_HANDOVER_MAGIC "FNETHND1"
+
+// Seconds either side waits for the other on a single send or receive
+// The handing process' loop is stalled for as long as the transfer takes
+#ifndef FNET_HANDOVER_TIMEOUT
+#define FNET_HANDOVER_TIMEOUT 5
+#endif
+
+#define FNET_HANDOVER_LISTENER   1
+#define FNET_HANDOVER_CONNECTION 2
+#define FNET_HANDOVER_END        3
+
+struct fnet_handover_rec {
+  uint32_t type;
+  uint32_t proto;
+  uint64_t id;   // Listener's id, or the listener that accepted the connection, 0 for none
+  uint64_t wlen;
+  uint64_t rlen;
+};
+
+// Blocking, 0 on success and -1 with errno set otherwise
+int _fnet_handover_send(int sock, const struct fnet_handover_rec *rec, int fd, const char *wdata, const char *rdata);
+int _fnet_handover_recv(int sock, struct fnet_handover_rec *rec, int *fd, struct buf *wbuf, struct buf *rbuf);
+int _fnet_handover_write(int sock, const void *data, size_t len);
+int _fnet_handover_read(int sock, void *data, size_t len);
+
+#endif // __INCLUDE_FINWO_FNET_HANDOVER_H__
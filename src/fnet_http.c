@@ -0,0 +1,663 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "tidwall/buf.h"
+
+#include "fnet.h"
+#include "fnet_http.h"
+
+// Bodies up to this size are copied behind the head, saving a send
+#define FNET_HTTP_COALESCE 16384
+
+struct fnet_http_conn {
+  struct fnet_http_options_t options;
+  struct fnet_http_req       req;
+  struct buf                 in;       // Received bytes not consumed yet, starting with the pending request
+  struct buf                 out;      // Responses not handed to fnet_write yet
+  size_t                     reqlen;   // Head and body of the pending request
+  bool                       busy;     // Request handed out, response not ended yet
+  bool                       head;     // Responding to a HEAD request or with a 1xx or 204, no body
+  bool                       chunked;  // Streaming with Transfer-Encoding: chunked
+  bool                       closing;  // Close once the response has ended
+  bool                       closed;
+  bool                       ended;    // Peer stopped sending, close once what's complete is answered
+  int                        depth;    // Reentrancy, only free when nobody's using us
+  int64_t                    charged;  // Reported to fnet_charge
+};
+
+// Finds the first occurrence of either character, or NULL
+// Header blocks are mostly long runs without delimiters, compare 16 or 32 bytes at once
+const char * _fnet_http_scan(const char *p, const char *end, char a, char b) {
+#if defined(__GNUC__) && defined(__AVX2__)
+  __m256i va = _mm256_set1_epi8(a);
+  __m256i vb = _mm256_set1_epi8(b);
+  while((end - p) >= 32) {
+    __m256i  v    = _mm256_loadu_si256((const __m256i *)p);
+    unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+    if (mask) return p + __builtin_ctz(mask);
+    p += 32;
+  }
+#endif
+#if defined(__GNUC__) && defined(__SSE2__)
+  __m128i xa = _mm_set1_epi8(a);
+  __m128i xb = _mm_set1_epi8(b);
+  while((end - p) >= 16) {
+    __m128i  v    = _mm_loadu_si128((const __m128i *)p);
+    unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, xa), _mm_cmpeq_epi8(v, xb)));
+    if (mask) return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  for ( ; p < end ; p++ ) {
+    if ((*p == a) || (*p == b)) return p;
+  }
+  return NULL;
+}
+
+char _fnet_http_lower(char c) {
+  return ((c >= 'A') && (c <= 'Z')) ? (c | 0x20) : c;
+}
+
+bool _fnet_http_ieq(const struct fnet_http_view *view, const char *str) {
+  size_t i;
+  size_t len = strlen(str);
+  if (view->len != len) return false;
+  for ( i = 0 ; i < len ; i++ ) {
+    if (_fnet_http_lower(view->data[i]) != _fnet_http_lower(str[i])) return false;
+  }
+  return true;
+}
+
+// Characters allowed in a header name
+bool _fnet_http_tchar(char c) {
+  if (((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9'))) return true;
+  return c && strchr("!#$%&'*+-.^_`|~", c);
+}
+
+// Whether a comma-separated header value contains the token
+bool _fnet_http_token(const struct fnet_http_view *value, const char *token) {
+  const char *p   = value->data;
+  const char *end = value->data + value->len;
+  const char *next;
+  struct fnet_http_view item;
+  while(p < end) {
+    next = memchr(p, ',', end - p);
+    if (!next) next = end;
+    item.data = p;
+    item.len  = next - p;
+    while(item.len && ((item.data[0] == ' ') || (item.data[0] == '\t'))) { item.data++; item.len--; }
+    while(item.len && ((item.data[item.len - 1] == ' ') || (item.data[item.len - 1] == '\t'))) item.len--;
+    if (_fnet_http_ieq(&item, token)) return true;
+    p = next + 1;
+  }
+  return false;
+}
+
+const struct fnet_http_view * fnet_http_header(const struct fnet_http_req *req, const char *name) {
+  int i;
+  if (!req || !name) return NULL;
+  for ( i = 0 ; i < req->nheaders ; i++ ) {
+    if (_fnet_http_ieq(&(req->headers[i].name), name)) return &(req->headers[i].value);
+  }
+  return NULL;
+}
+
+// Parses a request from data
+// Returns its length including the body, 0 when incomplete, or -1 with the status to respond with
+ssize_t _fnet_http_parse(struct fnet_http_req *req, const char *data, size_t len, size_t maxbody, int *status) {
+  const char *p   = data;
+  const char *end = data + len;
+  const char *eol, *sep;
+  const struct fnet_http_view *hdr;
+  struct fnet_http_header *h;
+  size_t clen = 0;
+  size_t n, i, digits;
+  bool   seen = false;
+  int    j;
+
+  req->nheaders = 0;
+  req->body     = (struct fnet_http_view){ NULL, 0 };
+
+  // Incomplete until we've seen the whole head
+  #define FNET_HTTP_NEED_MORE() do {                                      \
+      if (len > FNET_HTTP_MAX_HEAD) { *status = 431; return -1; }         \
+      return 0;                                                           \
+    } while(0)
+
+  // Request line
+  sep = _fnet_http_scan(p, end, ' ', '\n');
+  if (!sep) FNET_HTTP_NEED_MORE();
+  if ((*sep != ' ') || (sep == p)) { *status = 400; return -1; }
+  req->method = (struct fnet_http_view){ p, sep - p };
+  p = sep + 1;
+
+  sep = _fnet_http_scan(p, end, ' ', '\n');
+  if (!sep) FNET_HTTP_NEED_MORE();
+  if ((*sep != ' ') || (sep == p)) { *status = 400; return -1; }
+  req->target = (struct fnet_http_view){ p, sep - p };
+  p = sep + 1;
+
+  eol = _fnet_http_scan(p, end, '\n', '\n');
+  if (!eol) FNET_HTTP_NEED_MORE();
+  if (((eol - p) < 8) || memcmp(p, "HTTP/1.", 7) || (p[7] < '0') || (p[7] > '9')) {
+    *status = ((eol - p) >= 5) && !memcmp(p, "HTTP/", 5) ? 505 : 400;
+    return -1;
+  }
+  if (((eol - p) > 9) || (((eol - p) == 9) && (p[8] != '\r'))) { *status = 400; return -1; }
+  req->minor = p[7] - '0';
+  p = eol + 1;
+
+  // Headers, up to the empty line
+  for(;;) {
+    if ((p < end) && (*p == '\n')) { p += 1; break; }
+    if (((end - p) >= 2) && (p[0] == '\r') && (p[1] == '\n')) { p += 2; break; }
+
+    // Folded continuation lines are obsolete, and read differently by whoever is in front of us
+    if ((p < end) && ((*p == ' ') || (*p == '\t'))) { *status = 400; return -1; }
+
+    sep = _fnet_http_scan(p, end, ':', '\n');
+    if (!sep) FNET_HTTP_NEED_MORE();
+    if ((*sep != ':') || (sep == p)) { *status = 400; return -1; }
+    for ( eol = p ; (eol < sep) && _fnet_http_tchar(*eol) ; eol++ );
+    if (eol != sep) { *status = 400; return -1; }
+    eol = _fnet_http_scan(sep, end, '\n', '\n');
+    if (!eol) FNET_HTTP_NEED_MORE();
+    if (req->nheaders == FNET_HTTP_MAX_HEADERS) { *status = 431; return -1; }
+
+    h = &(req->headers[req->nheaders++]);
+    h->name = (struct fnet_http_view){ p, sep - p };
+    for ( sep++ ; (sep < eol) && ((*sep == ' ') || (*sep == '\t')) ; sep++ );
+    h->value = (struct fnet_http_view){ sep, eol - sep };
+    while(h->value.len && ((sep[h->value.len - 1] == '\r') || (sep[h->value.len - 1] == ' ') || (sep[h->value.len - 1] == '\t'))) {
+      h->value.len--;
+    }
+    p = eol + 1;
+  }
+  #undef FNET_HTTP_NEED_MORE
+
+  if ((p - data) > FNET_HTTP_MAX_HEAD) { *status = 431; return -1; }
+
+  // Chunked request bodies are not supported
+  if (fnet_http_header(req, "Transfer-Encoding")) { *status = 501; return -1; }
+
+  // Every Content-Length and every element of a list in one has to agree
+  // A proxy in front picking another one than us would frame the body differently
+  for ( j = 0 ; j < req->nheaders ; j++ ) {
+    if (!_fnet_http_ieq(&(req->headers[j].name), "Content-Length")) continue;
+    hdr = &(req->headers[j].value);
+    i   = 0;
+    do {
+      for ( ; (i < hdr->len) && ((hdr->data[i] == ' ') || (hdr->data[i] == '\t')) ; i++ );
+      for ( n = 0, digits = 0 ; (i < hdr->len) && (hdr->data[i] >= '0') && (hdr->data[i] <= '9') ; i++, digits++ ) {
+        if (n > maxbody) { *status = 413; return -1; }
+        n = (n * 10) + (hdr->data[i] - '0');
+      }
+      for ( ; (i < hdr->len) && ((hdr->data[i] == ' ') || (hdr->data[i] == '\t')) ; i++ );
+      if (!digits || ((i < hdr->len) && (hdr->data[i] != ','))) { *status = 400; return -1; }
+      if (n > maxbody) { *status = 413; return -1; }
+      if (seen && (n != clen)) { *status = 400; return -1; }
+      clen = n;
+      seen = true;
+    } while(i++ < hdr->len);
+  }
+  if ((size_t)(end - p) < clen) return 0;
+  req->body = (struct fnet_http_view){ p, clen };
+
+  hdr = fnet_http_header(req, "Connection");
+  if (req->minor) {
+    req->keepalive = !(hdr && _fnet_http_token(hdr, "close"));
+  } else {
+    req->keepalive = hdr && _fnet_http_token(hdr, "keep-alive");
+  }
+
+  return (p - data) + clen;
+}
+
+// Moves the request's views along with the bytes they point into
+void _fnet_http_rebase(struct fnet_http_req *req, const char *from, const char *to) {
+  int i;
+  #define FNET_HTTP_REBASE(VIEW) if ((VIEW).data) (VIEW).data = to + ((VIEW).data - from)
+  FNET_HTTP_REBASE(req->method);
+  FNET_HTTP_REBASE(req->target);
+  FNET_HTTP_REBASE(req->body);
+  for ( i = 0 ; i < req->nheaders ; i++ ) {
+    FNET_HTTP_REBASE(req->headers[i].name);
+    FNET_HTTP_REBASE(req->headers[i].value);
+  }
+  #undef FNET_HTTP_REBASE
+}
+
+const char * _fnet_http_reason(int status) {
+  switch(status) {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 411: return "Length Required";
+    case 413: return "Content Too Large";
+    case 414: return "URI Too Long";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    case 505: return "HTTP Version Not Supported";
+    default : return "Unknown";
+  }
+}
+
+// Keeps the connection's footprint in fnet's memory accounting up-to-date
+void _fnet_http_charge(struct fnet_http_conn *state) {
+  int64_t now = state->closed ? 0 : (int64_t)(sizeof(struct fnet_http_conn) + state->in.cap + state->out.cap);
+  if (now == state->charged) return;
+  fnet_charge(state->req.connection, now - state->charged);
+  state->charged = now;
+}
+
+void _fnet_http_release(struct fnet_http_conn *state) {
+  if (!state->closed || state->busy || state->depth) return;
+  if (state->in.data) free(state->in.data);
+  if (state->out.data) free(state->out.data);
+  free(state);
+}
+
+// Responses are collected and handed to fnet_write once per batch of pipelined requests
+bool _fnet_http_out(struct fnet_http_conn *state, const char *data, size_t len) {
+  return buf_append(&(state->out), data, len);
+}
+
+FNET_RETURNCODE _fnet_http_flush(struct fnet_http_conn *state) {
+  FNET_RETURNCODE ret;
+  if (!state->out.len || state->closed) return FNET_RETURNCODE_OK;
+  ret = fnet_write(state->req.connection, &(state->out));
+  state->out.len = 0;
+  return ret;
+}
+
+// Writes status line and headers, bodies up to FNET_HTTP_COALESCE ride along
+FNET_RETURNCODE _fnet_http_head(struct fnet_http_conn *state, int status, const struct fnet_http_header *headers, int nheaders, const struct buf *body, bool chunked) {
+  char line[64];
+  int  i, n;
+  bool ok = true;
+
+  n   = snprintf(line, sizeof(line), "HTTP/1.1 %d ", status);
+  ok &= _fnet_http_out(state, line, n);
+  ok &= _fnet_http_out(state, _fnet_http_reason(status), strlen(_fnet_http_reason(status)));
+  ok &= _fnet_http_out(state, "\r\n", 2);
+
+  for ( i = 0 ; i < nheaders ; i++ ) {
+    ok &= _fnet_http_out(state, headers[i].name.data, headers[i].name.len);
+    ok &= _fnet_http_out(state, ": ", 2);
+    ok &= _fnet_http_out(state, headers[i].value.data, headers[i].value.len);
+    ok &= _fnet_http_out(state, "\r\n", 2);
+  }
+
+  // Informational and 204 responses never have a body, nor a length for one
+  if ((status < 200) || (status == 204)) {
+    state->head = true;
+  } else if (chunked) {
+    ok &= _fnet_http_out(state, "Transfer-Encoding: chunked\r\n", 28);
+  } else if (body) {
+    n   = snprintf(line, sizeof(line), "Content-Length: %zu\r\n", (size_t)body->len);
+    ok &= _fnet_http_out(state, line, n);
+  }
+
+  if (state->closing) {
+    ok &= _fnet_http_out(state, "Connection: close\r\n", 19);
+  } else if (!state->req.minor) {
+    ok &= _fnet_http_out(state, "Connection: keep-alive\r\n", 24);
+  }
+  ok &= _fnet_http_out(state, "\r\n", 2);
+  if (!ok) return FNET_RETURNCODE_ERRNO;
+
+  if (!body || !body->len || state->head) return FNET_RETURNCODE_OK;
+  if (body->len <= FNET_HTTP_COALESCE) {
+    return _fnet_http_out(state, body->data, body->len) ? FNET_RETURNCODE_OK : FNET_RETURNCODE_ERRNO;
+  }
+
+  // Large bodies go out as-is, without copying
+  _fnet_http_flush(state);
+  return fnet_write(state->req.connection, (struct buf *)body);
+}
+
+// Hands out complete requests from data until one is still pending
+// Returns the amount of bytes consumed by requests that have been responded to
+size_t _fnet_http_run(struct fnet_http_conn *state, const char *data, size_t len) {
+  size_t  offset = 0;
+  ssize_t n;
+  int     status = 0;
+
+  state->depth++;
+  while(!state->busy && !state->closed && (offset < len)) {
+    n = _fnet_http_parse(&(state->req), data + offset, len - offset, state->options.maxBody, &status);
+    if (!n) break;
+
+    // Malformed, we can't tell where the next request starts
+    if (n < 0) {
+      state->closing = true;
+      state->head    = false;
+      _fnet_http_head(state, status, NULL, 0, &((struct buf){ .len = 0 }), false);
+      _fnet_http_flush(state);
+      fnet_close(state->req.connection);
+      offset = len;
+      break;
+    }
+
+    state->busy    = true;
+    state->reqlen  = n;
+    state->head    = _fnet_http_ieq(&(state->req.method), "HEAD");
+    state->chunked = false;
+    state->closing = !state->req.keepalive;
+
+    if (state->options.onRequest) {
+      state->options.onRequest(&(state->req));
+    } else {
+      fnet_http_respond(&(state->req), 404, NULL, 0, NULL);
+    }
+
+    // Responded to in the callback, otherwise its bytes must stay around
+    if (state->busy) break;
+    offset += n;
+  }
+  state->depth--;
+  return offset;
+}
+
+// Continues with what's buffered, the pending request always starts at in.data
+void _fnet_http_drain(struct fnet_http_conn *state) {
+  size_t consumed = _fnet_http_run(state, state->in.data, state->in.len);
+  if (!consumed) return;
+  if (state->busy) _fnet_http_rebase(&(state->req), state->in.data + consumed, state->in.data);
+  memmove(state->in.data, state->in.data + consumed, state->in.len - consumed);
+  state->in.len -= consumed;
+}
+
+void _fnet_http_onData(struct fnet_ev *ev) {
+  struct fnet_http_conn *state = ev->udata;
+  const char *data = ev->buffer->data;
+  size_t      len  = ev->buffer->len;
+  const char *old;
+  size_t      consumed;
+
+  state->depth++;
+
+  if (!state->in.len && !state->busy) {
+    // Parse straight from the receive buffer, only keep what's left
+    consumed = _fnet_http_run(state, data, len);
+    if ((consumed < len) && !state->closed) {
+      if (!buf_append(&(state->in), data + consumed, len - consumed)) {
+        fnet_close(ev->connection);
+      } else if (state->busy) {
+        _fnet_http_rebase(&(state->req), data + consumed, state->in.data);
+      }
+    }
+  } else {
+    old = state->in.data;
+    if (!buf_append(&(state->in), data, len)) {
+      fnet_close(ev->connection);
+    } else {
+      if (state->busy && (old != state->in.data)) _fnet_http_rebase(&(state->req), old, state->in.data);
+      if (!state->busy) _fnet_http_drain(state);
+    }
+  }
+
+  _fnet_http_flush(state);
+
+  // Nothing partial left, don't hold on to the buffer while idle
+  if (!state->in.len && state->in.data) {
+    free(state->in.data);
+    state->in = (struct buf){};
+  }
+  _fnet_http_charge(state);
+
+  state->depth--;
+  _fnet_http_release(state);
+}
+
+// Requests still buffered are answered, a partial one will never complete
+void _fnet_http_onEnd(struct fnet_ev *ev) {
+  struct fnet_http_conn *state = ev->udata;
+  state->ended = true;
+  if (state->busy) return;
+  _fnet_http_flush(state);
+  fnet_close(ev->connection);
+}
+
+void _fnet_http_onClose(struct fnet_ev *ev) {
+  struct fnet_http_conn *state = ev->udata;
+  state->closed = true;
+  _fnet_http_charge(state);
+  _fnet_http_release(state);
+}
+
+// onHandover for fnet_handover, only connections between requests move along
+void fnet_http_handover(struct fnet_ev *ev) {
+  struct fnet_http_conn *state = ev->udata;
+
+  if ((ev->connection->onData != _fnet_http_onData) || !state) return;
+  if (state->busy || state->ended || state->closed || state->out.len) {
+    ev->buffer = NULL;
+    return;
+  }
+  if (state->in.len && !buf_append(ev->buffer, state->in.data, state->in.len)) {
+    ev->buffer = NULL;
+  }
+}
+
+FNET_RETURNCODE fnet_http_attach(struct fnet_t *connection, const struct fnet_http_options_t *options) {
+  struct fnet_http_conn *state;
+
+  // Checking arguments are given
+  if (!connection) {
+    fprintf(stderr, "fnet_http_attach: connection argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  if (!options) {
+    fprintf(stderr, "fnet_http_attach: options argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+
+  state = calloc(1, sizeof(struct fnet_http_conn));
+  if (!state) return FNET_RETURNCODE_ERRNO;
+
+  state->options = *options;
+  if (!state->options.maxBody) state->options.maxBody = 1048576;
+  state->req.connection = connection;
+  state->req.udata      = options->udata;
+
+  connection->onData  = _fnet_http_onData;
+  connection->onEnd   = _fnet_http_onEnd;
+  connection->onClose = _fnet_http_onClose;
+  connection->udata   = state;
+  _fnet_http_charge(state);
+  return FNET_RETURNCODE_OK;
+}
+
+void _fnet_http_onConnect(struct fnet_ev *ev) {
+  if (fnet_http_attach(ev->connection, ev->udata) < 0) {
+    fnet_close(ev->connection);
+  }
+}
+
+void _fnet_http_onListenClose(struct fnet_ev *ev) {
+  free(ev->udata);
+}
+
+struct fnet_t * fnet_http_listen(const char *address, uint16_t port, const struct fnet_http_options_t *options) {
+  struct fnet_http_options_t *copy;
+  struct fnet_t              *listener;
+
+  if (!options) {
+    fprintf(stderr, "fnet_http_listen: options argument is required\n");
+    return NULL;
+  }
+
+  // Outlives the caller's options, freed when the listener closes
+  copy = malloc(sizeof(struct fnet_http_options_t));
+  if (!copy) return NULL;
+  *copy = *options;
+
+  // Failing right away doesn't close a listener, nobody else frees it then
+  listener = fnet_listen(address, port, &((struct fnet_options_t){
+    .proto     = FNET_PROTO_TCP,
+    .flags     = 0,
+    .onConnect = _fnet_http_onConnect,
+    .onClose   = _fnet_http_onListenClose,
+    .udata     = copy,
+  }));
+  if (!listener) free(copy);
+  return listener;
+}
+
+FNET_RETURNCODE fnet_http_respond(struct fnet_http_req *req, int status, const struct fnet_http_header *headers, int nheaders, const struct buf *body) {
+  struct fnet_http_conn *state;
+  FNET_RETURNCODE       ret = FNET_RETURNCODE_OK;
+
+  if (!req) {
+    fprintf(stderr, "fnet_http_respond: req argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  state = (struct fnet_http_conn *)(((char *)req) - offsetof(struct fnet_http_conn, req));
+  if (!state->busy || state->chunked) {
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+
+  if (!state->closed) {
+    ret = _fnet_http_head(state, status, headers, nheaders, body ? body : &((struct buf){ .len = 0 }), false);
+  }
+  state->chunked = false;
+  fnet_http_end(req);
+  return ret;
+}
+
+FNET_RETURNCODE fnet_http_start(struct fnet_http_req *req, int status, const struct fnet_http_header *headers, int nheaders) {
+  struct fnet_http_conn *state;
+  FNET_RETURNCODE       ret;
+
+  if (!req) {
+    fprintf(stderr, "fnet_http_start: req argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  state = (struct fnet_http_conn *)(((char *)req) - offsetof(struct fnet_http_conn, req));
+  if (!state->busy || state->chunked) {
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+  if (state->closed) {
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+
+  // HTTP/1.0 has no chunked encoding, the end of the body is the end of the connection
+  if (!req->minor) state->closing = true;
+  state->chunked = true;
+  ret = _fnet_http_head(state, status, headers, nheaders, NULL, req->minor > 0);
+  if (!state->depth) _fnet_http_flush(state);
+  return ret;
+}
+
+FNET_RETURNCODE fnet_http_chunk(struct fnet_http_req *req, const struct buf *chunk) {
+  struct fnet_http_conn *state;
+  char                  line[24];
+  int                   n;
+  bool                  ok = true;
+  FNET_RETURNCODE       ret = FNET_RETURNCODE_OK;
+
+  if (!req) {
+    fprintf(stderr, "fnet_http_chunk: req argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  state = (struct fnet_http_conn *)(((char *)req) - offsetof(struct fnet_http_conn, req));
+  if (!state->busy || !state->chunked || state->closed) {
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+
+  // An empty chunk would end the body
+  if (!chunk || !chunk->len || state->head) {
+    return FNET_RETURNCODE_OK;
+  }
+
+  if (req->minor) {
+    n   = snprintf(line, sizeof(line), "%zx\r\n", (size_t)chunk->len);
+    ok &= _fnet_http_out(state, line, n);
+  }
+  if (chunk->len <= FNET_HTTP_COALESCE) {
+    ok &= _fnet_http_out(state, chunk->data, chunk->len);
+  } else {
+    _fnet_http_flush(state);
+    ret = fnet_write(req->connection, (struct buf *)chunk);
+  }
+  if (req->minor) {
+    ok &= _fnet_http_out(state, "\r\n", 2);
+  }
+
+  if (!state->depth) _fnet_http_flush(state);
+  if (!ok) return FNET_RETURNCODE_ERRNO;
+  return ret;
+}
+
+FNET_RETURNCODE fnet_http_end(struct fnet_http_req *req) {
+  struct fnet_http_conn *state;
+
+  if (!req) {
+    fprintf(stderr, "fnet_http_end: req argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  state = (struct fnet_http_conn *)(((char *)req) - offsetof(struct fnet_http_conn, req));
+  if (!state->busy) {
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+
+  state->depth++;
+
+  if (state->chunked && req->minor && !state->head && !state->closed) {
+    _fnet_http_out(state, "0\r\n\r\n", 5);
+  }
+  state->chunked = false;
+  state->busy    = false;
+
+  if (state->closing && !state->closed) {
+    _fnet_http_flush(state);
+    fnet_close(req->connection);
+  }
+
+  // Ended later on, continue with pipelined requests
+  // When still inside _fnet_http_run, it continues by itself
+  if ((state->depth == 1) && !state->closed) {
+    memmove(state->in.data, state->in.data + state->reqlen, state->in.len - state->reqlen);
+    state->in.len -= state->reqlen;
+    _fnet_http_drain(state);
+    _fnet_http_flush(state);
+  }
+  if ((state->depth == 1) && state->ended && !state->busy && !state->closed) {
+    _fnet_http_flush(state);
+    fnet_close(req->connection);
+  }
+  _fnet_http_charge(state);
+
+  state->depth--;
+  _fnet_http_release(state);
+  return FNET_RETURNCODE_OK;
+}
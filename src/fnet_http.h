@@ -0,0 +1,69 @@
+#ifndef __INCLUDE_FINWO_FNET_HTTP_H__
+#define __INCLUDE_FINWO_FNET_HTTP_H__
+
+// HTTP/1.1 server on top of fnet
+//
+// Requests on a connection are handled one at a time and in order, pipelined
+// requests wait until the response to the previous one has ended. Views in a
+// request point into the receive buffer and stay valid until its response
+// has ended.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fnet.h"
+
+#ifndef FNET_HTTP_MAX_HEADERS
+#define FNET_HTTP_MAX_HEADERS 64
+#endif
+
+// Request line and headers, larger requests get a 431
+#ifndef FNET_HTTP_MAX_HEAD
+#define FNET_HTTP_MAX_HEAD 16384
+#endif
+
+#define FNET_HTTP_CALLBACK(NAME) void (*(NAME))(struct fnet_http_req *req)
+
+struct fnet_http_view {
+  const char *data;
+  size_t      len;
+};
+
+struct fnet_http_header {
+  struct fnet_http_view name;
+  struct fnet_http_view value;
+};
+
+struct fnet_http_req {
+  struct fnet_t           *connection;
+  struct fnet_http_view   method;
+  struct fnet_http_view   target;
+  int                     minor; // HTTP/1.<minor>
+  bool                    keepalive;
+  struct fnet_http_header headers[FNET_HTTP_MAX_HEADERS];
+  int                     nheaders;
+  struct fnet_http_view   body;
+  void                    *udata;
+};
+
+struct fnet_http_options_t {
+  FNET_HTTP_CALLBACK(onRequest);
+  void   *udata;
+  size_t maxBody; // Larger bodies get a 413, 0 = 1 MiB
+};
+
+struct fnet_t * fnet_http_listen(const char *address, uint16_t port, const struct fnet_http_options_t *options);
+FNET_RETURNCODE fnet_http_attach(struct fnet_t *connection, const struct fnet_http_options_t *options);
+
+// Pass as onHandover to fnet_handover to move idle keep-alive connections along
+void fnet_http_handover(struct fnet_ev *ev);
+
+const struct fnet_http_view * fnet_http_header(const struct fnet_http_req *req, const char *name);
+
+FNET_RETURNCODE fnet_http_respond(struct fnet_http_req *req, int status, const struct fnet_http_header *headers, int nheaders, const struct buf *body);
+FNET_RETURNCODE fnet_http_start(struct fnet_http_req *req, int status, const struct fnet_http_header *headers, int nheaders);
+FNET_RETURNCODE fnet_http_chunk(struct fnet_http_req *req, const struct buf *chunk);
+FNET_RETURNCODE fnet_http_end(struct fnet_http_req *req);
+
+#endif // __INCLUDE_FINWO_FNET_HTTP_H__
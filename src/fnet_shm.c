@@ -0,0 +1,408 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // memfd_create
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "fnet_shm.h"
+
+#if !defined(__linux__)
+
+int _fnet_shm_listen(const char *name) {
+  errno = ENOSYS;
+  return -1;
+}
+struct fnet_shm_t * _fnet_shm_connect(const char *name, size_t size) {
+  errno = ENOSYS;
+  return NULL;
+}
+bool _fnet_shm_ready(int fd) {
+  return true;
+}
+struct fnet_shm_t * _fnet_shm_accept(int fd) {
+  errno = ENOSYS;
+  return NULL;
+}
+size_t _fnet_shm_write(struct fnet_shm_t *shm, const char *data, size_t len) {
+  return 0;
+}
+size_t _fnet_shm_read(struct fnet_shm_t *shm, struct buf *into, size_t max) {
+  return 0;
+}
+bool _fnet_shm_sleep(struct fnet_shm_t *shm) {
+  return true;
+}
+void _fnet_shm_ack(struct fnet_shm_t *shm) {
+}
+bool _fnet_shm_ended(struct fnet_shm_t *shm) {
+  return true;
+}
+void _fnet_shm_end(struct fnet_shm_t *shm) {
+}
+void _fnet_shm_free(struct fnet_shm_t *shm) {
+}
+
+#else
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 2
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS   1033
+#define F_GET_SEALS   1034
+#define F_SEAL_SEAL   0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW   0x0004
+#endif
+
+// The memfd can't be resized behind our back once mapped
+#define FNET_SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+#define FNET_SHM_MAGIC "FNETSHM1"
+#define FNET_SHM_MIN   4096
+#define FNET_SHM_MAX   1073741824
+
+// Fields written by different sides live on their own cache lines
+struct fnet_shm_ring {
+  _Atomic uint64_t head;   // Bytes ever written, only stored by the producer
+  char             _pad0[56];
+  _Atomic uint64_t tail;   // Bytes ever read, only stored by the consumer
+  char             _pad1[56];
+  _Atomic uint32_t asleep; // Consumer waits for its doorbell
+  char             _pad2[60];
+  _Atomic uint32_t wwait;  // Producer waits for room
+  _Atomic uint32_t closed; // Producer won't write anymore
+  char             _pad3[56];
+};
+
+// Sent with the memfd and both doorbells
+struct fnet_shm_hello {
+  char     magic[8];
+  uint64_t size;
+};
+
+// Abstract names, nothing to clean up in the filesystem
+socklen_t _fnet_shm_addr(const char *name, struct sockaddr_un *addr) {
+  int n;
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "fnet-shm/%s", name);
+  if ((n < 0) || ((size_t)n >= (sizeof(addr->sun_path) - 1))) {
+    errno = ENAMETOOLONG;
+    return 0;
+  }
+  return offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+void _fnet_shm_bell(int fd) {
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one))) {
+    // Already rung when the counter's full
+  }
+}
+
+struct fnet_shm_t * _fnet_shm_map(int memfd, size_t size, bool connecting) {
+  struct fnet_shm_t    *shm = calloc(1, sizeof(struct fnet_shm_t));
+  struct fnet_shm_ring *rings[2];
+
+  if (!shm) return NULL;
+  shm->spin    = 1;
+  shm->size    = size;
+  shm->mapsize = 2 * (sizeof(struct fnet_shm_ring) + size);
+  shm->map     = mmap(NULL, shm->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (shm->map == MAP_FAILED) {
+    free(shm);
+    return NULL;
+  }
+
+  // The first ring carries what the connecting side writes
+  rings[0] = (struct fnet_shm_ring *)shm->map;
+  rings[1] = (struct fnet_shm_ring *)(shm->map + sizeof(struct fnet_shm_ring) + size);
+  shm->out = rings[connecting ? 0 : 1];
+  shm->in  = rings[connecting ? 1 : 0];
+  return shm;
+}
+
+int _fnet_shm_listen(const char *name) {
+  struct sockaddr_un addr;
+  socklen_t addrlen = _fnet_shm_addr(name, &addr);
+  int fd;
+
+  if (!addrlen) return -1;
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (bind(fd, (struct sockaddr *)&addr, addrlen) || listen(fd, SOMAXCONN)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+struct fnet_shm_t * _fnet_shm_connect(const char *name, size_t size) {
+  struct fnet_shm_t     *shm = NULL;
+  struct fnet_shm_hello hello;
+  struct sockaddr_un    addr;
+  socklen_t             addrlen = _fnet_shm_addr(name, &addr);
+  union {
+    struct cmsghdr hdr;
+    char           buf[CMSG_SPACE(3 * sizeof(int))];
+  } cmsg = {};
+  struct iovec  iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cmsg.buf, .msg_controllen = sizeof(cmsg.buf) };
+  int fds[3] = { -1, -1, -1 }; // memfd, our bell, the peer's bell
+  int ctl    = -1;
+  int err;
+
+  if (!addrlen) return NULL;
+  if (!size) size = FNET_SHM_SIZE;
+  if (size > FNET_SHM_MAX) size = FNET_SHM_MAX;
+  for ( hello.size = FNET_SHM_MIN ; hello.size < size ; hello.size <<= 1 );
+  memcpy(hello.magic, FNET_SHM_MAGIC, sizeof(hello.magic));
+
+  fds[0] = syscall(SYS_memfd_create, "fnet-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if ((fds[0] < 0) || (fds[1] < 0) || (fds[2] < 0)) goto fail;
+  if (ftruncate(fds[0], 2 * (sizeof(struct fnet_shm_ring) + hello.size))) goto fail;
+  if (fcntl(fds[0], F_ADD_SEALS, FNET_SHM_SEALS)) goto fail;
+  shm = _fnet_shm_map(fds[0], hello.size, true);
+  if (!shm) goto fail;
+
+  // Sent before the listener accepts, the socket's buffer holds it until then
+  ctl = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (ctl < 0) goto fail;
+  if (connect(ctl, (struct sockaddr *)&addr, addrlen)) goto fail;
+  cmsg.hdr.cmsg_level = SOL_SOCKET;
+  cmsg.hdr.cmsg_type  = SCM_RIGHTS;
+  cmsg.hdr.cmsg_len   = CMSG_LEN(3 * sizeof(int));
+  memcpy(CMSG_DATA(&cmsg.hdr), fds, sizeof(fds));
+  if (sendmsg(ctl, &msg, MSG_NOSIGNAL) != sizeof(hello)) goto fail;
+  if (fcntl(ctl, F_SETFL, fcntl(ctl, F_GETFL) | O_NONBLOCK)) goto fail;
+
+  close(fds[0]);
+  shm->bell     = fds[1];
+  shm->peerbell = fds[2];
+  shm->ctl      = ctl;
+  return shm;
+
+fail:
+  err = errno;
+  if (shm) {
+    munmap(shm->map, shm->mapsize);
+    free(shm);
+  }
+  if (ctl >= 0) close(ctl);
+  if (fds[0] >= 0) close(fds[0]);
+  if (fds[1] >= 0) close(fds[1]);
+  if (fds[2] >= 0) close(fds[2]);
+  errno = err;
+  return NULL;
+}
+
+bool _fnet_shm_ready(int fd) {
+  char c;
+  if (recv(fd, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT) >= 0) return true;
+  return (errno != EAGAIN) && (errno != EWOULDBLOCK);
+}
+
+// Takes ownership of fd, closed when the handshake fails
+struct fnet_shm_t * _fnet_shm_accept(int fd) {
+  struct fnet_shm_t     *shm = NULL;
+  struct fnet_shm_hello hello;
+  struct cmsghdr        *hdr;
+  struct stat           st;
+  struct ucred          cred;
+  socklen_t             credlen = sizeof(cred);
+  int                   seals;
+  union {
+    struct cmsghdr hdr;
+    char           buf[CMSG_SPACE(3 * sizeof(int))];
+  } cmsg = {};
+  struct iovec  iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cmsg.buf, .msg_controllen = sizeof(cmsg.buf) };
+  int fds[3] = { -1, -1, -1 };
+
+  // Only processes of our own user, or root, get to share memory with us
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen)) goto fail;
+  if ((cred.uid != geteuid()) && (cred.uid != 0)) goto fail;
+
+  // Never waits, the peer had its chance to send it
+  if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT) != sizeof(hello)) goto fail;
+  hdr = CMSG_FIRSTHDR(&msg);
+  if (!hdr || (hdr->cmsg_level != SOL_SOCKET) || (hdr->cmsg_type != SCM_RIGHTS)) goto fail;
+
+  // Whatever did come along gets closed when it's not what we expect
+  memcpy(fds, CMSG_DATA(hdr), (hdr->cmsg_len - CMSG_LEN(0)) < sizeof(fds) ? (hdr->cmsg_len - CMSG_LEN(0)) : sizeof(fds));
+  if (hdr->cmsg_len != CMSG_LEN(3 * sizeof(int))) goto fail;
+
+  // Don't trust the peer's word on the size, and make sure it stays that way
+  if (memcmp(hello.magic, FNET_SHM_MAGIC, sizeof(hello.magic))) goto fail;
+  if ((hello.size < FNET_SHM_MIN) || (hello.size > FNET_SHM_MAX) || (hello.size & (hello.size - 1))) goto fail;
+  seals = fcntl(fds[0], F_GET_SEALS);
+  if ((seals < 0) || ((seals & FNET_SHM_SEALS) != FNET_SHM_SEALS)) goto fail;
+  if (fstat(fds[0], &st) || ((uint64_t)st.st_size != 2 * (sizeof(struct fnet_shm_ring) + hello.size))) goto fail;
+
+  shm = _fnet_shm_map(fds[0], hello.size, false);
+  if (!shm) goto fail;
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) goto fail;
+
+  close(fds[0]);
+  shm->bell     = fds[2];
+  shm->peerbell = fds[1];
+  shm->ctl      = fd;
+  return shm;
+
+fail:
+  if (shm) {
+    munmap(shm->map, shm->mapsize);
+    free(shm);
+  }
+  if (fds[0] >= 0) close(fds[0]);
+  if (fds[1] >= 0) close(fds[1]);
+  if (fds[2] >= 0) close(fds[2]);
+  close(fd);
+  return NULL;
+}
+
+// The peer can write anything into the ring headers, a position it reports
+// that's more than a ring away from ours breaks the connection
+bool _fnet_shm_broken(struct fnet_shm_t *shm, uint64_t used) {
+  if (used <= shm->size) return false;
+  shm->broken = true;
+  errno       = EPROTO;
+  return true;
+}
+
+size_t _fnet_shm_write(struct fnet_shm_t *shm, const char *data, size_t len) {
+  struct fnet_shm_ring *ring = shm->out;
+  char     *base = (char *)(ring + 1);
+  uint64_t head  = shm->wpos;
+  uint64_t tail;
+  size_t   n = 0, part, off;
+
+  if (shm->broken) return 0;
+  for (;;) {
+    tail = atomic_load_explicit(&(ring->tail), memory_order_acquire);
+    if (_fnet_shm_broken(shm, head - tail)) break;
+    part = shm->size - (head - tail);
+    if (part > (len - n)) part = len - n;
+    off = head & (shm->size - 1);
+    if ((off + part) > shm->size) {
+      memcpy(base + off, data + n, shm->size - off);
+      memcpy(base, data + n + shm->size - off, part - (shm->size - off));
+    } else if (part) {
+      memcpy(base + off, data + n, part);
+    }
+    head     += part;
+    n        += part;
+    shm->wpos = head;
+    atomic_store_explicit(&(ring->head), head, memory_order_release);
+    if (n == len) break;
+
+    // Full, have the reader ring once it made room, unless it already did
+    atomic_store(&(ring->wwait), 1);
+    if (atomic_load(&(ring->tail)) == tail) break;
+  }
+
+  // Pairs with the reader's check before sleeping, one of both sees the other
+  atomic_thread_fence(memory_order_seq_cst);
+  if (n && atomic_load_explicit(&(ring->asleep), memory_order_relaxed) && atomic_exchange(&(ring->asleep), 0)) {
+    _fnet_shm_bell(shm->peerbell);
+  }
+  return n;
+}
+
+size_t _fnet_shm_read(struct fnet_shm_t *shm, struct buf *into, size_t max) {
+  struct fnet_shm_ring *ring = shm->in;
+  char     *base = (char *)(ring + 1);
+  uint64_t tail  = shm->rpos;
+  uint64_t head  = atomic_load_explicit(&(ring->head), memory_order_acquire);
+  size_t   n     = head - tail;
+  size_t   off   = tail & (shm->size - 1);
+  char     *data;
+
+  if (shm->broken || _fnet_shm_broken(shm, head - tail)) return 0;
+  if (n > max) n = max;
+  if (!n) return 0;
+  if ((into->len + n) > into->cap) {
+    data = realloc(into->data, into->len + n);
+    if (!data) return 0;
+    into->data = data;
+    into->cap  = into->len + n;
+  }
+
+  if ((off + n) > shm->size) {
+    memcpy(into->data + into->len, base + off, shm->size - off);
+    memcpy(into->data + into->len + shm->size - off, base, n - (shm->size - off));
+  } else {
+    memcpy(into->data + into->len, base + off, n);
+  }
+  into->len += n;
+  shm->rpos  = tail + n;
+  atomic_store_explicit(&(ring->tail), shm->rpos, memory_order_release);
+
+  // Pairs with the writer's check after finding the ring full
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&(ring->wwait), memory_order_relaxed) && atomic_exchange(&(ring->wwait), 0)) {
+    _fnet_shm_bell(shm->peerbell);
+  }
+  return n;
+}
+
+bool _fnet_shm_sleep(struct fnet_shm_t *shm) {
+  struct fnet_shm_ring *ring = shm->in;
+
+  // Announce first, then look again, a writer either sees us asleep or we see its data
+  atomic_store(&(ring->asleep), 1);
+  if ((atomic_load(&(ring->head)) == shm->rpos) && !atomic_load(&(ring->closed)) && !shm->broken) {
+    return true;
+  }
+  atomic_store(&(ring->asleep), 0);
+  return false;
+}
+
+void _fnet_shm_ack(struct fnet_shm_t *shm) {
+  uint64_t count;
+  if (read(shm->bell, &count, sizeof(count))) {
+    // Nothing to do when it wasn't rung
+  }
+}
+
+bool _fnet_shm_ended(struct fnet_shm_t *shm) {
+  struct fnet_shm_ring *ring = shm->in;
+  if (!atomic_load(&(ring->closed))) return false;
+  return atomic_load(&(ring->head)) == shm->rpos;
+}
+
+void _fnet_shm_end(struct fnet_shm_t *shm) {
+  if (atomic_exchange(&(shm->out->closed), 1)) return;
+  _fnet_shm_bell(shm->peerbell);
+}
+
+void _fnet_shm_free(struct fnet_shm_t *shm) {
+  _fnet_shm_end(shm);
+  munmap(shm->map, shm->mapsize);
+  close(shm->peerbell);
+  free(shm);
+}
+
+#endif
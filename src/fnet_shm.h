@@ -0,0 +1,85 @@
+#ifndef __INCLUDE_FINWO_FNET_SHM_H__
+#define __INCLUDE_FINWO_FNET_SHM_H__
+
+// Shared memory transport behind FNET_PROTO_SHM, linux-only
+//
+// A connection is a memfd holding a single-producer single-consumer byte ring
+// per direction, and an eventfd doorbell per side. The connecting side creates
+// them and hands them over through an abstract unix socket named after the
+// listener, which stays open so either side notices the other going away.
+// Doorbells are only rung for a reader that's about to sleep or a writer
+// waiting for room, peers that keep each other busy don't make syscalls.
+//
+// Only processes of the same user, or root, are accepted as peers. Still, the
+// peer can write anything into the rings. The memfd has to come sealed against
+// resizing, and positions are kept on our side and checked against the ones
+// the peer reports, a connection where they don't add up is broken.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "tidwall/buf.h"
+
+// Ring size the connecting side asks for, rounded up to a power of 2
+#ifndef FNET_SHM_SIZE
+#define FNET_SHM_SIZE 1048576
+#endif
+
+// Most passes a reader keeps looking at an empty ring before going to sleep
+// Adapts to how soon data tends to show up, on a shared cpu that's never
+#ifndef FNET_SHM_SPIN
+#define FNET_SHM_SPIN 64
+#endif
+
+struct fnet_shm_ring;
+
+struct fnet_shm_t {
+  char                 *map;
+  size_t               mapsize;
+  size_t               size;     // Data bytes per ring
+  struct fnet_shm_ring *in;      // Written by the peer
+  struct fnet_shm_ring *out;     // Written by us
+  int                  bell;     // Rung by the peer, polled by the loop
+  int                  peerbell;
+  int                  ctl;      // Rendezvous socket, hangs up when the peer is gone
+  int                  idle;     // Empty looks at the ring since data last arrived
+  int                  spin;     // Empty looks before sleeping, 1 to FNET_SHM_SPIN
+  uint64_t             rpos;     // Our own tail of in and head of out, never taken from the rings
+  uint64_t             wpos;
+  bool                 broken;   // The peer reported impossible positions, errno was EPROTO
+};
+
+#if defined(__linux__)
+// Abstract address the listener for the name binds to, 0 when the name is too long
+socklen_t           _fnet_shm_addr(const char *name, struct sockaddr_un *addr);
+#endif
+
+// Listening socket for the name, accepted fds go to _fnet_shm_accept
+// once _fnet_shm_ready says the peer's rings arrived, or it hung up
+int                 _fnet_shm_listen(const char *name);
+struct fnet_shm_t * _fnet_shm_connect(const char *name, size_t size);
+bool                _fnet_shm_ready(int fd);
+struct fnet_shm_t * _fnet_shm_accept(int fd);
+
+// Non-blocking, return the bytes moved, 0 once broken
+size_t              _fnet_shm_write(struct fnet_shm_t *shm, const char *data, size_t len);
+size_t              _fnet_shm_read(struct fnet_shm_t *shm, struct buf *into, size_t max);
+
+// True when asleep, false when data arrived meanwhile
+bool                _fnet_shm_sleep(struct fnet_shm_t *shm);
+void                _fnet_shm_ack(struct fnet_shm_t *shm);
+
+// Peer closed its ring and everything in it was read
+bool                _fnet_shm_ended(struct fnet_shm_t *shm);
+void                _fnet_shm_end(struct fnet_shm_t *shm);
+
+// Ends our ring and unmaps, bell and ctl are left to the owner
+void                _fnet_shm_free(struct fnet_shm_t *shm);
+
+#endif // __INCLUDE_FINWO_FNET_SHM_H__
@@ -0,0 +1,109 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "fnet.h"
+#include "fnet_trace.h"
+
+struct fnet_trace_rec *fnet_trace_ring = NULL;
+uint64_t              fnet_trace_head  = 0;
+uint64_t              fnet_trace_mask  = 0;
+
+uint64_t _fnet_trace_now() {
+#if defined(_WIN32) || defined(_WIN64)
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (uint64_t)((count.QuadPart * 1000000000.0) / freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * ((uint64_t)1000000000)) + ts.tv_nsec;
+#endif
+}
+
+void _fnet_trace(uint32_t type, uint64_t conn, int32_t arg) {
+  struct fnet_trace_rec *rec = &fnet_trace_ring[fnet_trace_head & fnet_trace_mask];
+  rec->ts   = _fnet_trace_now();
+  rec->conn = conn;
+  rec->type = type;
+  rec->arg  = arg;
+  fnet_trace_head++;
+}
+
+FNET_RETURNCODE fnet_trace_start(size_t nevents) {
+  size_t size = 1;
+
+  if (!nevents) {
+    fprintf(stderr, "fnet_trace_start: nevents argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  if (fnet_trace_ring) {
+    return FNET_RETURNCODE_ALREADY_ACTIVE;
+  }
+
+  // Power of 2 allows masking instead of modulo
+  while(size < nevents) size <<= 1;
+
+  fnet_trace_ring = calloc(size, sizeof(struct fnet_trace_rec));
+  if (!fnet_trace_ring) {
+    return FNET_RETURNCODE_ERRNO;
+  }
+  fnet_trace_head = 0;
+  fnet_trace_mask = size - 1;
+  return FNET_RETURNCODE_OK;
+}
+
+FNET_RETURNCODE fnet_trace_stop() {
+  if (fnet_trace_ring) free(fnet_trace_ring);
+  fnet_trace_ring = NULL;
+  fnet_trace_head = 0;
+  fnet_trace_mask = 0;
+  return FNET_RETURNCODE_OK;
+}
+
+FNET_RETURNCODE fnet_trace_dump(const char *filename) {
+  struct fnet_trace_header header = {};
+  uint64_t size, start, i;
+  FILE *fp;
+
+  if (!filename) {
+    fprintf(stderr, "fnet_trace_dump: filename argument is required\n");
+    return FNET_RETURNCODE_MISSING_ARGUMENT;
+  }
+  if (!fnet_trace_ring) {
+    fprintf(stderr, "fnet_trace_dump: tracing was not started\n");
+    return FNET_RETURNCODE_UNPROCESSABLE;
+  }
+
+  size  = fnet_trace_mask + 1;
+  start = (fnet_trace_head > size) ? (fnet_trace_head - size) : 0;
+
+  memcpy(header.magic, FNET_TRACE_MAGIC, sizeof(header.magic));
+  header.recsize = sizeof(struct fnet_trace_rec);
+  header.count   = fnet_trace_head - start;
+  header.dropped = start;
+
+  fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "fnet_trace_dump: %s\n", strerror(errno));
+    return FNET_RETURNCODE_ERRNO;
+  }
+
+  fwrite(&header, sizeof(header), 1, fp);
+  for ( i = start ; i < fnet_trace_head ; i++ ) {
+    fwrite(&fnet_trace_ring[i & fnet_trace_mask], sizeof(struct fnet_trace_rec), 1, fp);
+  }
+
+  if (fclose(fp)) {
+    return FNET_RETURNCODE_ERRNO;
+  }
+  return FNET_RETURNCODE_OK;
+}
@@ -0,0 +1,74 @@
+#ifndef __INCLUDE_FINWO_FNET_TRACE_H__
+#define __INCLUDE_FINWO_FNET_TRACE_H__
+
+#include <stdint.h>
+
+// Binary trace format, shared with util/fnet_trace2json
+//
+// A dump is a header followed by header.count records, oldest first.
+// Timestamps are in nanoseconds on a monotonic clock.
+
+#define FNET_TRACE_MAGIC "FNETTRC1"
+
+#define FNET_TRACE_WAIT         1 // Entering fpoll_wait, arg = timeout in ms
+#define FNET_TRACE_WAKEUP       2 // Returned from fpoll_wait, arg = event count
+#define FNET_TRACE_CB_ENTER     3 // Calling a user callback, arg = FNET_EVENT_*
+#define FNET_TRACE_CB_EXIT      4 // Returned from a user callback, arg = FNET_EVENT_*
+#define FNET_TRACE_RECV         5 // arg = bytes received
+#define FNET_TRACE_SEND         6 // arg = bytes sent
+#define FNET_TRACE_SEND_PARTIAL 7 // arg = bytes sent
+#define FNET_TRACE_SEND_EAGAIN  8
+#define FNET_TRACE_ACCEPT       9 // conn = the new connection
+#define FNET_TRACE_CLOSE       10
+#define FNET_TRACE_TICK_ENTER  11 // Entering fnet_tick's list walk
+#define FNET_TRACE_TICK_EXIT   12 // arg = connections walked
+#define FNET_TRACE_SHED        13
+
+struct fnet_trace_header {
+  char     magic[8];
+  uint32_t recsize;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t dropped; // Records overwritten before the dump
+};
+
+struct fnet_trace_rec {
+  uint64_t ts;
+  uint64_t conn;
+  uint32_t type;
+  int32_t  arg;
+};
+
+#ifndef FNET_TRACE_FORMAT_ONLY
+
+// Probes cost a nop when not attached to, the ring a single branch when not started
+#if !defined(FNET_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define FNET_PROBE(EV, CONN, ARG) DTRACE_PROBE2(fnet, EV, CONN, ARG)
+#endif
+#endif
+#ifndef FNET_PROBE
+#define FNET_PROBE(EV, CONN, ARG)
+#endif
+
+#ifdef FNET_NO_TRACE
+#define FNET_TRACE(EV, CONN, ARG)
+#else
+#define FNET_TRACE(EV, CONN, ARG) do {                                \
+    uint64_t _fnet_trace_conn = (CONN) ? (CONN)->id : 0;              \
+    FNET_PROBE(EV, _fnet_trace_conn, ARG);                            \
+    if (fnet_trace_ring) {                                            \
+      _fnet_trace(FNET_TRACE_##EV, _fnet_trace_conn, (int32_t)(ARG)); \
+    }                                                                 \
+  } while(0)
+#endif
+
+extern struct fnet_trace_rec *fnet_trace_ring;
+
+uint64_t _fnet_trace_now();
+void     _fnet_trace(uint32_t type, uint64_t conn, int32_t arg);
+
+#endif // FNET_TRACE_FORMAT_ONLY
+
+#endif // __INCLUDE_FINWO_FNET_TRACE_H__
@@ -0,0 +1,155 @@
+// Resolver cache, lookups joining one in flight, and connections going away while resolving
+// Build and run with `make check`
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fnet.h"
+#include "fnet_dns.h"
+
+// Resolvable from /etc/hosts, and never resolvable at all
+#define NAME    "localhost"
+#define NONAME  "fnet-test.invalid"
+
+int failed = 0;
+
+#define CHECK(cond) do {                                               \
+    if (!(cond)) {                                                     \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failed++;                                                        \
+    }                                                                  \
+  } while(0)
+
+struct answer {
+  int calls;
+  int error;
+  bool addrs;
+};
+
+void onResolved(const struct addrinfo *addrs, int error, void *udata) {
+  struct answer *answer = udata;
+  answer->calls++;
+  answer->error = error;
+  answer->addrs = addrs != NULL;
+}
+
+struct fnet_dns_stats_t counters() {
+  struct fnet_dns_stats_t out;
+  fnet_dns_stats(&out);
+  return out;
+}
+
+void test_cache() {
+  struct fnet_dns_stats_t before;
+  struct answer           answer = {};
+
+  fnet_dns(&((struct fnet_dns_options_t){ .ttl = 100, .negativeTtl = 100 }));
+  fnet_dns_flush();
+
+  // Outside of the loop lookups block, the second one is a hit
+  before = counters();
+  CHECK(!fnet_resolve(NAME, 80, onResolved, &answer));
+  CHECK(!fnet_resolve(NAME, 80, onResolved, &answer));
+  CHECK(answer.calls == 2);
+  CHECK(!answer.error && answer.addrs);
+  CHECK(counters().misses == before.misses + 1);
+  CHECK(counters().hits == before.hits + 1);
+
+  // Past the ttl it's asked again
+  usleep(150000);
+  before = counters();
+  CHECK(!fnet_resolve(NAME, 80, onResolved, &answer));
+  CHECK(answer.calls == 3);
+  CHECK(counters().expired == before.expired + 1);
+  CHECK(counters().misses == before.misses + 1);
+
+  // Failures are cached too
+  before = counters();
+  CHECK(!fnet_resolve(NONAME, 80, onResolved, &answer));
+  CHECK(answer.error && !answer.addrs);
+  answer.error = 0;
+  CHECK(!fnet_resolve(NONAME, 80, onResolved, &answer));
+  CHECK(answer.error && !answer.addrs);
+  CHECK(answer.calls == 5);
+  CHECK(counters().misses == before.misses + 1);
+  CHECK(counters().hits == before.hits + 1);
+
+  fnet_dns(&((struct fnet_dns_options_t){}));
+  fnet_dns_flush();
+}
+
+struct answer           first    = {};
+struct answer           second   = {};
+struct fnet_dns_stats_t before   = {};
+int                     connects = 0;
+int                     closes   = 0;
+int                     error    = 0;
+
+void onConnect(struct fnet_ev *ev) {
+  connects++;
+}
+
+void onClose(struct fnet_ev *ev) {
+  closes++;
+  error = ev->connection->error;
+}
+
+void onStart(struct fnet_ev *ev) {
+  struct fnet_t *conn;
+
+  before = counters();
+
+  // The second lookup for the same name rides along with the first one
+  CHECK(fnet_resolve(NAME, 81, onResolved, &first));
+  CHECK(fnet_resolve(NAME, 81, onResolved, &second));
+  CHECK(!first.calls && !second.calls);
+  CHECK(counters().misses == before.misses + 1);
+  CHECK(counters().joined == before.joined + 1);
+
+  // Freed before the lookup completes, it must not call back into the connection
+  conn = fnet_connect(NAME, 82, &((struct fnet_options_t){
+    .proto     = FNET_PROTO_TCP,
+    .onConnect = onConnect,
+  }));
+  CHECK(conn);
+  if (conn) fnet_free(conn);
+
+  // Not resolving is reported as the reason for closing
+  CHECK(fnet_connect(NONAME, 83, &((struct fnet_options_t){
+    .proto     = FNET_PROTO_TCP,
+    .onConnect = onConnect,
+    .onClose   = onClose,
+  })));
+}
+
+void onStop(struct fnet_ev *ev) {
+  fnet_shutdown();
+}
+
+void test_loop() {
+  fnet_timer(0, onStart, NULL);
+  fnet_timer(500, onStop, NULL);
+  fnet_main();
+
+  CHECK(first.calls == 1);
+  CHECK(second.calls == 1);
+  CHECK(!first.error && first.addrs);
+  CHECK(!second.error && second.addrs);
+  CHECK(!connects);
+  CHECK(closes == 1);
+  CHECK(error == EHOSTUNREACH);
+}
+
+int main() {
+  test_cache();
+  test_loop();
+  if (failed) {
+    fprintf(stderr, "dns: %d checks failed\n", failed);
+    return 1;
+  }
+  printf("dns: ok\n");
+  return 0;
+}
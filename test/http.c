@@ -0,0 +1,219 @@
+// Parser cases on literal buffers, and pipelined and chunked responses over a socketpair
+// Build and run with `make check`
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "fnet.h"
+#include "fnet_http.h"
+
+ssize_t _fnet_http_parse(struct fnet_http_req *req, const char *data, size_t len, size_t maxbody, int *status);
+
+int failed = 0;
+
+#define CHECK(cond) do {                                               \
+    if (!(cond)) {                                                     \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failed++;                                                        \
+    }                                                                  \
+  } while(0)
+
+// Length of the parsed request, 0 when incomplete, or minus the error status
+ssize_t parse(struct fnet_http_req *req, const char *data) {
+  int     status = 0;
+  ssize_t n      = _fnet_http_parse(req, data, strlen(data), 1024, &status);
+  return (n < 0) ? -status : n;
+}
+
+bool is(const struct fnet_http_view *view, const char *str) {
+  return view && (view->len == strlen(str)) && !memcmp(view->data, str, view->len);
+}
+
+void test_parse() {
+  struct fnet_http_req req;
+  const char *pipelined = "GET /a HTTP/1.1\r\n\r\nPOST /b HTTP/1.1\r\nContent-Length: 3\r\n\r\nabcGET";
+  char  large[FNET_HTTP_MAX_HEAD + 64];
+  char  *p;
+  int   i;
+
+  CHECK(parse(&req, "GET /index.html HTTP/1.1\r\nHost: example\r\n\r\n") == 43);
+  CHECK(is(&req.method, "GET"));
+  CHECK(is(&req.target, "/index.html"));
+  CHECK(is(fnet_http_header(&req, "host"), "example"));
+  CHECK(req.minor == 1);
+  CHECK(req.keepalive);
+  CHECK(!req.body.len);
+
+  // Bare newlines, and HTTP/1.0 only keeps the connection when asked to
+  CHECK(parse(&req, "GET / HTTP/1.0\n\n") == 16);
+  CHECK(!req.keepalive);
+  CHECK(parse(&req, "GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n") > 0);
+  CHECK(req.keepalive);
+  CHECK(parse(&req, "GET / HTTP/1.1\r\nConnection: close\r\n\r\n") > 0);
+  CHECK(!req.keepalive);
+
+  // Incomplete heads and bodies
+  CHECK(parse(&req, "GET / HT") == 0);
+  CHECK(parse(&req, "GET / HTTP/1.1\r\nHost: x\r\n") == 0);
+  CHECK(parse(&req, "POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\nabc") == 0);
+  CHECK(parse(&req, "POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\nabcde") == 43);
+  CHECK(is(&req.body, "abcde"));
+
+  // Pipelined requests parse one after the other
+  CHECK(parse(&req, pipelined) == 19);
+  CHECK(is(&req.target, "/a"));
+  CHECK(parse(&req, pipelined + 19) == 42);
+  CHECK(is(&req.target, "/b"));
+  CHECK(is(&req.body, "abc"));
+  CHECK(parse(&req, pipelined + 61) == 0);
+
+  // Malformed request lines
+  CHECK(parse(&req, "GET\r\n\r\n") == -400);
+  CHECK(parse(&req, " / HTTP/1.1\r\n\r\n") == -400);
+  CHECK(parse(&req, "GET  HTTP/1.1\r\n\r\n") == -400);
+  CHECK(parse(&req, "GET / FOO/1.1\r\n\r\n") == -400);
+  CHECK(parse(&req, "GET / HTTP/2.0\r\n\r\n") == -505);
+  CHECK(parse(&req, "GET / HTTP/1.1x\r\n\r\n") == -400);
+  CHECK(parse(&req, "GET / HTTP/1.1 \r\n\r\n") == -400);
+  CHECK(parse(&req, "GET / HTTP/1.10\r\n\r\n") == -400);
+
+  // Malformed headers
+  CHECK(parse(&req, "GET / HTTP/1.1\r\nNoColon\r\n\r\n") == -400);
+  CHECK(parse(&req, "GET / HTTP/1.1\r\n: empty\r\n\r\n") == -400);
+  CHECK(parse(&req, "GET / HTTP/1.1\r\nHost : x\r\n\r\n") == -400);
+  CHECK(parse(&req, "GET / HTTP/1.1\r\nX Y: x\r\n\r\n") == -400);
+  CHECK(parse(&req, "GET / HTTP/1.1\r\nX(Y): x\r\n\r\n") == -400);
+  CHECK(parse(&req, "GET / HTTP/1.1\r\nX-Y_z.1~: x\r\n\r\n") == 31);
+
+  // Folded lines, leading whitespace would otherwise smuggle a header past a proxy
+  CHECK(parse(&req, "GET / HTTP/1.1\r\nX: a\r\n b\r\n\r\n") == -400);
+  CHECK(parse(&req, "GET / HTTP/1.1\r\nX: a\r\n\tb\r\n\r\n") == -400);
+  CHECK(parse(&req, "GET / HTTP/1.1\r\n Host: x\r\n\r\n") == -400);
+  CHECK(parse(&req, "GET / HTTP/1.1\r\n ") == -400);
+
+  // Bodies we won't take
+  CHECK(parse(&req, "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n") == -501);
+  CHECK(parse(&req, "POST / HTTP/1.1\r\nContent-Length: 1025\r\n\r\n") == -413);
+  CHECK(parse(&req, "POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n") == -413);
+
+  // Content-Length has to be unambiguous
+  CHECK(parse(&req, "POST / HTTP/1.1\r\nContent-Length: \r\n\r\n") == -400);
+  CHECK(parse(&req, "POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n") == -400);
+  CHECK(parse(&req, "POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n") == -400);
+  CHECK(parse(&req, "POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\nab") == -400);
+  CHECK(parse(&req, "POST / HTTP/1.1\r\nContent-Length: 2\r\ncontent-length: 2\r\n\r\nab") == 59);
+  CHECK(parse(&req, "POST / HTTP/1.1\r\nContent-Length: 2, 2\r\n\r\nab") == 43);
+  CHECK(parse(&req, "POST / HTTP/1.1\r\nContent-Length: 2, 3\r\n\r\nabc") == -400);
+  CHECK(parse(&req, "POST / HTTP/1.1\r\nContent-Length: 2,\r\n\r\nab") == -400);
+  CHECK(parse(&req, "POST / HTTP/1.1\r\nContent-Length: ,2\r\n\r\nab") == -400);
+
+  // Too many headers, or a head that doesn't end
+  p = large + sprintf(large, "GET / HTTP/1.1\r\n");
+  for ( i = 0 ; i <= FNET_HTTP_MAX_HEADERS ; i++ ) p += sprintf(p, "X: %d\r\n", i);
+  strcpy(p, "\r\n");
+  CHECK(parse(&req, large) == -431);
+  p = large + sprintf(large, "GET / HTTP/1.1\r\nX: ");
+  memset(p, 'a', (large + sizeof(large) - 1) - p);
+  large[sizeof(large) - 1] = '\0';
+  CHECK(parse(&req, large) == -431);
+}
+
+void onRequest(struct fnet_http_req *req) {
+  if (is(&req->target, "/stream")) {
+    fnet_http_start(req, 200, NULL, 0);
+    fnet_http_chunk(req, &((struct buf){ .len = 5, .data = "hello" }));
+    fnet_http_chunk(req, &((struct buf){ .len = 5, .data = "world" }));
+    fnet_http_end(req);
+    return;
+  }
+  if (is(&req->target, "/empty")) {
+    fnet_http_respond(req, 204, NULL, 0, &((struct buf){ .len = 2, .data = "no" }));
+    return;
+  }
+  fnet_http_respond(req, 200, NULL, 0, &((struct buf){ .len = 2, .data = "ok" }));
+}
+
+void onStop(struct fnet_ev *ev) {
+  fnet_shutdown();
+}
+
+// Sends the input to a server on one end of a socketpair, returns what comes back until it closes
+char * exchange(const char *input) {
+  static char out[4096];
+  size_t      len = 0;
+  ssize_t     n;
+  int         sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    perror("socketpair");
+    exit(1);
+  }
+  fnet_http_attach(fnet_adopt(sv[0], &((struct fnet_options_t){ .proto = FNET_PROTO_TCP })), &((struct fnet_http_options_t){
+    .onRequest = onRequest,
+  }));
+  if (write(sv[1], input, strlen(input)) != (ssize_t)strlen(input)) {
+    perror("write");
+    exit(1);
+  }
+  fnet_timer(200, onStop, NULL);
+  fnet_main();
+
+  while((len < (sizeof(out) - 1)) && ((n = recv(sv[1], out + len, sizeof(out) - 1 - len, MSG_DONTWAIT)) > 0)) {
+    len += n;
+  }
+  out[len] = '\0';
+  close(sv[1]);
+  return out;
+}
+
+void test_server() {
+  // Responses in request order, the last one closes
+  CHECK(!strcmp(exchange(
+    "GET /a HTTP/1.1\r\n\r\n"
+    "GET /stream HTTP/1.1\r\n\r\n"
+    "GET /b HTTP/1.1\r\nConnection: close\r\n\r\n"
+    "GET /never HTTP/1.1\r\n\r\n"
+  ),
+    "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok"
+    "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n5\r\nworld\r\n0\r\n\r\n"
+    "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok"
+  ));
+
+  // HTTP/1.0 streams without chunks, ended by closing
+  CHECK(!strcmp(exchange("GET /stream HTTP/1.0\r\n\r\n"),
+    "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nhelloworld"
+  ));
+
+  // No Content has no body, and no length for it either
+  CHECK(!strcmp(exchange("GET /empty HTTP/1.1\r\n\r\nGET /b HTTP/1.1\r\nConnection: close\r\n\r\n"),
+    "HTTP/1.1 204 No Content\r\n\r\n"
+    "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok"
+  ));
+
+  // Errors are answered, then the connection is closed
+  CHECK(!strcmp(exchange("POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\nab"),
+    "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+  ));
+}
+
+void test_listen() {
+  // Options copied for a listener that failed to open don't leak
+  CHECK(!fnet_http_listen(NULL, 8080, &((struct fnet_http_options_t){ .onRequest = onRequest })));
+}
+
+int main() {
+  test_parse();
+  test_server();
+  test_listen();
+  if (failed) {
+    fprintf(stderr, "http: %d checks failed\n", failed);
+    return 1;
+  }
+  printf("http: ok\n");
+  return 0;
+}
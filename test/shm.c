@@ -0,0 +1,270 @@
+// Ring arithmetic of the shared memory transport, and what it does with a hostile peer
+// Build and run with `make check`
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // memfd_create
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "fnet_shm.h"
+
+#if !defined(__linux__)
+
+int main() {
+  printf("shm: linux-only, skipped\n");
+  return 0;
+}
+
+#else
+
+#define SIZE 4096
+
+// Positions as laid out at the start of struct fnet_shm_ring, each on its own cache line
+#define HEAD(ring) ((volatile uint64_t *)(ring))
+#define TAIL(ring) ((volatile uint64_t *)((char *)(ring) + 64))
+#define RING_HEADER 256
+
+int failed = 0;
+
+#define CHECK(cond) do {                                               \
+    if (!(cond)) {                                                     \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failed++;                                                        \
+    }                                                                  \
+  } while(0)
+
+struct pair {
+  int               lfd;
+  struct fnet_shm_t *client;
+  struct fnet_shm_t *server;
+};
+
+struct pair open_pair(const char *name) {
+  struct pair p = {};
+  p.lfd    = _fnet_shm_listen(name);
+  p.client = _fnet_shm_connect(name, SIZE);
+  p.server = (p.lfd >= 0) ? _fnet_shm_accept(accept(p.lfd, NULL, NULL)) : NULL;
+  if (!p.client || !p.server) {
+    fprintf(stderr, "shm: unable to open a pair: %s\n", strerror(errno));
+    exit(1);
+  }
+  return p;
+}
+
+void close_shm(struct fnet_shm_t *shm) {
+  close(shm->bell);
+  close(shm->ctl);
+  _fnet_shm_free(shm);
+}
+
+void close_pair(struct pair *p) {
+  close_shm(p->client);
+  close_shm(p->server);
+  close(p->lfd);
+}
+
+void fill(char *data, size_t len, char seed) {
+  size_t i;
+  for ( i = 0 ; i < len ; i++ ) data[i] = (char)(seed + i * 7);
+}
+
+void test_wraparound() {
+  struct pair p  = open_pair("test-wrap");
+  struct buf  in = {};
+  char        data[3000];
+
+  // The second write crosses the end of the ring
+  fill(data, sizeof(data), 1);
+  CHECK(_fnet_shm_write(p.client, data, sizeof(data)) == sizeof(data));
+  CHECK(_fnet_shm_read(p.server, &in, SIZE) == sizeof(data));
+  CHECK(!memcmp(in.data, data, sizeof(data)));
+
+  in.len = 0;
+  fill(data, sizeof(data), 2);
+  CHECK(_fnet_shm_write(p.client, data, sizeof(data)) == sizeof(data));
+  CHECK(_fnet_shm_read(p.server, &in, SIZE) == sizeof(data));
+  CHECK(!memcmp(in.data, data, sizeof(data)));
+
+  // Reads cut off at max continue where they left off, across the end too
+  in.len = 0;
+  fill(data, sizeof(data), 3);
+  CHECK(_fnet_shm_write(p.client, data, sizeof(data)) == sizeof(data));
+  CHECK(_fnet_shm_read(p.server, &in, 1000) == 1000);
+  CHECK(_fnet_shm_read(p.server, &in, SIZE) == 2000);
+  CHECK(!memcmp(in.data, data, sizeof(data)));
+  CHECK(_fnet_shm_read(p.server, &in, SIZE) == 0);
+  CHECK(!p.server->broken && !p.client->broken);
+
+  free(in.data);
+  close_pair(&p);
+}
+
+void test_full() {
+  struct pair p  = open_pair("test-full");
+  struct buf  in = {};
+  char        data[SIZE + 1000];
+
+  fill(data, sizeof(data), 4);
+  CHECK(_fnet_shm_write(p.client, data, sizeof(data)) == SIZE);
+  CHECK(_fnet_shm_write(p.client, data + SIZE, 10) == 0);
+
+  // Room for exactly what was read
+  CHECK(_fnet_shm_read(p.server, &in, 100) == 100);
+  CHECK(_fnet_shm_write(p.client, data + SIZE, 1000) == 100);
+  CHECK(_fnet_shm_read(p.server, &in, sizeof(data)) == SIZE);
+  CHECK(in.len == (SIZE + 100));
+  CHECK(!memcmp(in.data, data, SIZE + 100));
+
+  free(in.data);
+  close_pair(&p);
+}
+
+void test_hostile() {
+  struct pair p;
+  struct buf  in = {};
+  char        data[SIZE];
+
+  // Announcing more than a ring's worth would read past it
+  p = open_pair("test-head");
+  *HEAD(p.client->out) = *TAIL(p.client->out) + (1 << 20);
+  CHECK(_fnet_shm_read(p.server, &in, 262144) == 0);
+  CHECK(p.server->broken);
+  CHECK(!in.len);
+  CHECK(_fnet_shm_write(p.server, "x", 1) == 0);
+  close_pair(&p);
+
+  // Just over the ring is as bad, and so is going backwards
+  p = open_pair("test-head2");
+  *HEAD(p.client->out) = SIZE + 1;
+  CHECK(_fnet_shm_read(p.server, &in, 262144) == 0);
+  CHECK(p.server->broken);
+  close_pair(&p);
+
+  p = open_pair("test-head3");
+  CHECK(_fnet_shm_write(p.client, data, 100) == 100);
+  CHECK(_fnet_shm_read(p.server, &in, SIZE) == 100);
+  *HEAD(p.client->out) = 50;
+  CHECK(_fnet_shm_read(p.server, &in, SIZE) == 0);
+  CHECK(p.server->broken);
+  close_pair(&p);
+
+  // The peer moving its tail past our head would have us write past the mapping
+  p = open_pair("test-tail");
+  CHECK(_fnet_shm_write(p.server, data, 100) == 100);
+  *TAIL(p.client->in) = 100 + SIZE;
+  CHECK(_fnet_shm_write(p.server, data, SIZE) == 0);
+  CHECK(p.server->broken);
+  close_pair(&p);
+
+  // Overwriting our own tail in the ring doesn't move where we read from
+  p = open_pair("test-own");
+  fill(data, 200, 5);
+  CHECK(_fnet_shm_write(p.client, data, 200) == 200);
+  CHECK(_fnet_shm_read(p.server, &in, 100) == 100);
+  *TAIL(p.server->in) = 0;
+  in.len = 0;
+  CHECK(_fnet_shm_read(p.server, &in, SIZE) == 100);
+  CHECK(!memcmp(in.data, data + 100, 100));
+  CHECK(!p.server->broken);
+  close_pair(&p);
+
+  free(in.data);
+}
+
+// Hands the listener a memfd by hand, sealed or not
+struct fnet_shm_t * handshake(const char *name, unsigned int seals) {
+  struct { char magic[8]; uint64_t size; } hello = { "FNETSHM1", SIZE };
+  struct sockaddr_un addr;
+  socklen_t          addrlen = _fnet_shm_addr(name, &addr);
+  union {
+    struct cmsghdr hdr;
+    char           buf[CMSG_SPACE(3 * sizeof(int))];
+  } cmsg = {};
+  struct iovec      iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+  struct msghdr     msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cmsg.buf, .msg_controllen = sizeof(cmsg.buf) };
+  struct fnet_shm_t *shm;
+  int fds[3], lfd, ctl;
+
+  lfd    = _fnet_shm_listen(name);
+  ctl    = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  fds[0] = syscall(SYS_memfd_create, "test", MFD_ALLOW_SEALING);
+  fds[1] = eventfd(0, EFD_NONBLOCK);
+  fds[2] = eventfd(0, EFD_NONBLOCK);
+  if (ftruncate(fds[0], 2 * (RING_HEADER + SIZE))) perror("ftruncate");
+  if (seals && fcntl(fds[0], F_ADD_SEALS, seals)) perror("F_ADD_SEALS");
+  if (connect(ctl, (struct sockaddr *)&addr, addrlen)) perror("connect");
+  cmsg.hdr.cmsg_level = SOL_SOCKET;
+  cmsg.hdr.cmsg_type  = SCM_RIGHTS;
+  cmsg.hdr.cmsg_len   = CMSG_LEN(3 * sizeof(int));
+  memcpy(CMSG_DATA(&cmsg.hdr), fds, sizeof(fds));
+  if (sendmsg(ctl, &msg, 0) != sizeof(hello)) perror("sendmsg");
+
+  shm = _fnet_shm_accept(accept(lfd, NULL, NULL));
+  close(fds[0]);
+  close(fds[1]);
+  close(fds[2]);
+  close(ctl);
+  close(lfd);
+  return shm;
+}
+
+void test_ready() {
+  struct sockaddr_un addr;
+  socklen_t          addrlen = _fnet_shm_addr("test-ready", &addr);
+  int lfd, ctl, fd;
+
+  // Connected but silent isn't ready, hanging up is, so the handshake can fail
+  lfd = _fnet_shm_listen("test-ready");
+  ctl = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (connect(ctl, (struct sockaddr *)&addr, addrlen)) perror("connect");
+  fd  = accept(lfd, NULL, NULL);
+  CHECK(!_fnet_shm_ready(fd));
+  close(ctl);
+  CHECK(_fnet_shm_ready(fd));
+  CHECK(!_fnet_shm_accept(fd));
+  close(lfd);
+}
+
+void test_seals() {
+  struct fnet_shm_t *shm;
+
+  // A peer that could still resize the memfd would be able to SIGBUS us
+  CHECK(!handshake("test-unsealed", 0));
+  CHECK(!handshake("test-shrinkable", F_SEAL_GROW | F_SEAL_SEAL));
+  CHECK(!handshake("test-resealable", F_SEAL_SHRINK | F_SEAL_GROW));
+
+  shm = handshake("test-sealed", F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+  CHECK(shm);
+  if (shm) close_shm(shm);
+}
+
+int main() {
+  test_wraparound();
+  test_full();
+  test_hostile();
+  test_ready();
+  test_seals();
+  if (failed) {
+    fprintf(stderr, "shm: %d checks failed\n", failed);
+    return 1;
+  }
+  printf("shm: ok\n");
+  return 0;
+}
+
+#endif
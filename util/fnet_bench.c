@@ -0,0 +1,250 @@
+// Loopback benchmark, a pipelining client against an fnet server in a child process
+//
+// Modes:
+//   echo  raw echo server, the baseline
+//   http  fnet_http server answering every request with a fixed response
+//   fair  ping-pong latency on one connection while bulk senders flood another
+//         port, --fair 1 turns on read budgets and priority classes
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fnet.h"
+#include "fnet_http.h"
+
+#define PING     "ping ping ping ping ping ping ping ping ping ping ping ping ping ping ping!\n"
+
+#define REQUEST  "GET /bench HTTP/1.1\r\nHost: localhost\r\nUser-Agent: fnet_bench\r\nAccept: */*\r\n\r\n"
+#define RESPONSE "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok"
+
+void echo_onData(struct fnet_ev *ev) {
+  fnet_write(ev->connection, ev->buffer);
+}
+
+void echo_onConnect(struct fnet_ev *ev) {
+  ev->connection->onData = echo_onData;
+}
+
+// Stands in for parsing what's received, so bulk data costs the loop some time
+void sink_onData(struct fnet_ev *ev) {
+  static volatile uint32_t sum = 0;
+  size_t i;
+  for ( i = 0 ; i < ev->buffer->len ; i++ ) sum = (sum * 31) + ev->buffer->data[i];
+}
+
+void sink_onConnect(struct fnet_ev *ev) {
+  ev->connection->onData = sink_onData;
+}
+
+void http_onRequest(struct fnet_http_req *req) {
+  fnet_http_respond(req, 200, NULL, 0, &((struct buf){ .len = 2, .data = "ok" }));
+}
+
+void server(const char *mode, uint16_t port, int fair) {
+  if (!strcmp(mode, "fair")) {
+    if (fair) fnet_fairness(&((struct fnet_fairness_t){ .budget = 16384 }));
+    fnet_listen("127.0.0.1", port, &((struct fnet_options_t){
+      .proto     = FNET_PROTO_TCP,
+      .onConnect = echo_onConnect,
+      .priority  = fair ? FNET_PRIORITY_HIGH : FNET_PRIORITY_NORMAL,
+    }));
+    fnet_listen("127.0.0.1", port + 1, &((struct fnet_options_t){
+      .proto     = FNET_PROTO_TCP,
+      .onConnect = sink_onConnect,
+      .priority  = fair ? FNET_PRIORITY_BULK : FNET_PRIORITY_NORMAL,
+    }));
+  } else if (!strcmp(mode, "http")) {
+    fnet_http_listen("127.0.0.1", port, &((struct fnet_http_options_t){
+      .onRequest = http_onRequest,
+    }));
+  } else {
+    fnet_listen("127.0.0.1", port, &((struct fnet_options_t){
+      .proto     = FNET_PROTO_TCP,
+      .onConnect = echo_onConnect,
+    }));
+  }
+  fnet_main();
+  exit(0);
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+int dial(uint16_t port) {
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+  int fd;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) return fd;
+  close(fd);
+  return -1;
+}
+
+// Writes as fast as the server takes it until killed
+void bulk_sender(uint16_t port) {
+  static char chunk[65536];
+  int fd = dial(port);
+  if (fd < 0) exit(1);
+  for(;;) {
+    if (write(fd, chunk, sizeof(chunk)) < 0) exit(1);
+  }
+}
+
+int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Round trips on the interactive port while the bulk senders run
+int fair_client(int fd, double seconds) {
+  size_t  len = strlen(PING);
+  size_t  n = 0, cap = 65536, got;
+  double  *lat = malloc(cap * sizeof(double));
+  double  start = now(), t;
+  char    in[sizeof(PING)];
+  ssize_t r;
+
+  while(lat && ((now() - start) < seconds)) {
+    t = now();
+    if (write(fd, PING, len) != (ssize_t)len) break;
+    for( got = 0 ; got < len ; got += r ) {
+      r = read(fd, in + got, len - got);
+      if (r <= 0) break;
+    }
+    if (got < len) break;
+    if (n == cap) {
+      cap *= 2;
+      lat  = realloc(lat, cap * sizeof(double));
+      if (!lat) break;
+    }
+    lat[n++] = now() - t;
+  }
+  if (!lat || !n) {
+    fprintf(stderr, "No round trips completed\n");
+    return 1;
+  }
+
+  qsort(lat, n, sizeof(double), cmp_double);
+  printf("roundtrips: %zu\n", n);
+  printf("rtt p50   : %.1f us\n", lat[n / 2] * 1e6);
+  printf("rtt p99   : %.1f us\n", lat[(n * 99) / 100] * 1e6);
+  printf("rtt max   : %.1f us\n", lat[n - 1] * 1e6);
+  free(lat);
+  return 0;
+}
+
+int main(int argc, const char *argv[]) {
+  const char *mode    = "http";
+  uint16_t   port     = 8480;
+  int        depth    = 16;
+  int        fair     = 0;
+  int        bulk     = 4;
+  double     seconds  = 3;
+  size_t     reqlen   = strlen(REQUEST);
+  size_t     resplen;
+  char       *out, *in;
+  int        i, ret, fd = -1;
+  pid_t      pid, *bulkpids;
+  double     start, elapsed, lat, latmax = 0;
+  uint64_t   requests = 0, batches = 0;
+  size_t     want, got;
+  ssize_t    n;
+
+  for( i = 1 ; i < argc ; i++ ) {
+    if (!strcmp("--mode", argv[i]) && ((i + 1) < argc)) { mode = argv[++i]; continue; }
+    if (!strcmp("--port", argv[i]) && ((i + 1) < argc)) { port = atoi(argv[++i]); continue; }
+    if (!strcmp("--depth", argv[i]) && ((i + 1) < argc)) { depth = atoi(argv[++i]); continue; }
+    if (!strcmp("--seconds", argv[i]) && ((i + 1) < argc)) { seconds = atof(argv[++i]); continue; }
+    if (!strcmp("--fair", argv[i]) && ((i + 1) < argc)) { fair = atoi(argv[++i]); continue; }
+    if (!strcmp("--bulk", argv[i]) && ((i + 1) < argc)) { bulk = atoi(argv[++i]); continue; }
+    fprintf(stderr, "Usage: %s [--mode echo|http|fair] [--port n] [--depth n] [--seconds n] [--fair 0|1] [--bulk n]\n", argv[0]);
+    return 1;
+  }
+  if (depth < 1) depth = 1;
+  resplen = strcmp(mode, "http") ? reqlen : strlen(RESPONSE);
+
+  pid = fork();
+  if (!pid) server(mode, port, fair);
+
+  // Wait for the server to come up
+  for( i = 0 ; i < 100 ; i++ ) {
+    if ((fd = dial(port)) >= 0) break;
+    usleep(10000);
+  }
+  if (fd < 0) {
+    fprintf(stderr, "Could not connect to the server\n");
+    kill(pid, SIGTERM);
+    return 1;
+  }
+
+  if (!strcmp(mode, "fair")) {
+    bulkpids = calloc(bulk + 1, sizeof(pid_t));
+    for( i = 0 ; i < bulk ; i++ ) {
+      if (!(bulkpids[i] = fork())) bulk_sender(port + 1);
+    }
+    usleep(100000);
+
+    printf("mode      : fair\n");
+    printf("fair      : %s\n", fair ? "budget 16384, priority classes" : "off");
+    printf("bulk      : %d senders\n", bulk);
+    ret = fair_client(fd, seconds);
+
+    for( i = 0 ; i < bulk ; i++ ) kill(bulkpids[i], SIGTERM);
+    for( i = 0 ; i < bulk ; i++ ) waitpid(bulkpids[i], NULL, 0);
+    close(fd);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    free(bulkpids);
+    return ret;
+  }
+
+  out = malloc(reqlen * depth);
+  in  = malloc(resplen * depth);
+  for( i = 0 ; i < depth ; i++ ) memcpy(out + (i * reqlen), REQUEST, reqlen);
+  want = resplen * depth;
+
+  start = now();
+  while((elapsed = now() - start) < seconds) {
+    lat = now();
+    if (write(fd, out, reqlen * depth) != (ssize_t)(reqlen * depth)) break;
+    for( got = 0 ; got < want ; got += n ) {
+      n = read(fd, in + got, want - got);
+      if (n <= 0) break;
+    }
+    if (got < want) break;
+    lat = now() - lat;
+    if (lat > latmax) latmax = lat;
+    requests += depth;
+    batches++;
+  }
+
+  if (!strcmp(mode, "http") && memcmp(in, RESPONSE, resplen)) {
+    fprintf(stderr, "Unexpected response: %.*s\n", (int)resplen, in);
+  }
+
+  printf("mode     : %s\n", mode);
+  printf("depth    : %d\n", depth);
+  printf("requests : %llu\n", (unsigned long long)requests);
+  printf("req/s    : %.0f\n", requests / elapsed);
+  printf("batch avg: %.1f us\n", batches ? (elapsed / batches) * 1e6 : 0);
+  printf("batch max: %.1f us\n", latmax * 1e6);
+
+  close(fd);
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  free(out);
+  free(in);
+  return 0;
+}
@@ -0,0 +1,346 @@
+// Replays a capture made by fnet_capture_start against a server
+//
+// Every connection the capturing server accepted is opened again and sent
+// what it received, on the recorded schedule or faster. What the server
+// wrote back then is what's waited for now, the time until that many bytes
+// arrived is reported as the latency of each exchange.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fnet.h"
+
+#define FNET_CAPTURE_FORMAT_ONLY
+#include "fnet_capture.h"
+
+struct mark {
+  uint64_t threshold; // Received bytes that complete the exchange
+  double   sent;
+};
+
+struct session {
+  uint64_t       id;
+  struct fnet_t  *conn;
+  uint64_t       expected;
+  uint64_t       received;
+  struct mark    *marks;
+  size_t         nmarks;
+  size_t         mhead;
+  int            closing;
+  int            done;
+};
+
+struct fnet_capture_rec **recs     = NULL;
+uint64_t                *expect    = NULL; // Response bytes following each recorded RECV
+size_t                  nrecs      = 0;
+size_t                  cursor     = 0;
+
+struct session *sessions  = NULL;
+size_t         nsessions  = 0;
+size_t         *lookup    = NULL; // Capture connection id to session, open addressing
+size_t         lookupmask  = 0;
+
+const char *host    = "127.0.0.1";
+uint16_t   port     = 8080;
+double     speed    = 1;
+double     timeout  = 5;
+double     start    = 0;
+uint64_t   t0       = 0;
+int        nopen    = 0;
+int        finished = 0;
+
+double   *latencies = NULL;
+size_t   nlatencies = 0;
+double   lagmax     = 0;
+uint64_t sent       = 0;
+uint64_t cut        = 0;
+uint64_t failed     = 0;
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+struct session * session_find(uint64_t id) {
+  size_t i;
+  for ( i = id & lookupmask ; lookup[i] ; i = (i + 1) & lookupmask ) {
+    if (sessions[lookup[i] - 1].id == id) return &(sessions[lookup[i] - 1]);
+  }
+  return NULL;
+}
+
+int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+void finish() {
+  size_t i;
+  uint64_t received = 0, expected = 0;
+  double elapsed = now() - start;
+
+  if (finished) return;
+  finished = 1;
+
+  for ( i = 0 ; i < nsessions ; i++ ) {
+    received += sessions[i].received;
+    expected += sessions[i].expected;
+    if (sessions[i].received < sessions[i].expected) cut++;
+    if (sessions[i].conn) fnet_close(sessions[i].conn);
+  }
+  qsort(latencies, nlatencies, sizeof(double), cmp_double);
+
+  printf("sessions : %zu (%" PRIu64 " cut short, %" PRIu64 " failed to connect)\n", nsessions, cut, failed);
+  printf("sent     : %" PRIu64 " bytes\n", sent);
+  printf("received : %" PRIu64 " of %" PRIu64 " bytes\n", received, expected);
+  printf("duration : %.3f s (captured %.3f s, speed %g)\n", elapsed,
+    nrecs ? (recs[nrecs - 1]->ts - t0) / 1e9 : 0, speed);
+  printf("lag max  : %.3f ms\n", lagmax * 1e3);
+  printf("exchanges: %zu\n", nlatencies);
+  if (nlatencies) {
+    printf("lat p50  : %.1f us\n", latencies[nlatencies / 2] * 1e6);
+    printf("lat p90  : %.1f us\n", latencies[(nlatencies * 9) / 10] * 1e6);
+    printf("lat p99  : %.1f us\n", latencies[(nlatencies * 99) / 100] * 1e6);
+    printf("lat max  : %.1f us\n", latencies[nlatencies - 1] * 1e6);
+  }
+
+  fnet_shutdown();
+}
+
+void onTimeout(struct fnet_ev *ev) {
+  finish();
+}
+
+void session_settle(struct session *session) {
+  if (session->closing && !session->done && (session->received >= session->expected)) {
+    fnet_close(session->conn);
+  }
+}
+
+void onData(struct fnet_ev *ev) {
+  struct session *session = ev->udata;
+  struct mark    *mark;
+  double         t = now();
+
+  session->received += ev->buffer->len;
+  while(session->mhead < session->nmarks) {
+    mark = &(session->marks[session->mhead]);
+    if (session->received < mark->threshold) break;
+    latencies[nlatencies++] = t - mark->sent;
+    session->mhead++;
+  }
+  session_settle(session);
+}
+
+void onClose(struct fnet_ev *ev) {
+  struct session *session = ev->udata;
+  session->conn = NULL;
+  session->done = 1;
+  nopen--;
+
+  // Shutting down frees the connection we're called for, leave that to a timer
+  if ((cursor == nrecs) && !nopen && !finished) fnet_timer(0, onTimeout, NULL);
+}
+
+void apply(size_t i) {
+  struct fnet_capture_rec *rec     = recs[i];
+  struct session          *session = session_find(rec->conn);
+  struct mark             *mark;
+
+  // Only what the server accepted is replayed, its own outgoing connections aren't
+  if (!session || session->done) return;
+
+  switch(rec->type) {
+    case FNET_CAPTURE_ACCEPT:
+      // Counted first, onClose already fires when connecting fails
+      nopen++;
+      session->conn = fnet_connect(host, port, &((struct fnet_options_t){
+        .proto   = FNET_PROTO_TCP,
+        .onData  = onData,
+        .onClose = onClose,
+        .udata   = session,
+      }));
+      if (!session->conn) failed++;
+      break;
+    case FNET_CAPTURE_RECV:
+      if (!session->conn) break;
+      if (expect[i]) {
+        mark            = &(session->marks[session->nmarks++]);
+        session->expected += expect[i];
+        mark->threshold = session->expected;
+        mark->sent      = now();
+      }
+      fnet_write(session->conn, &((struct buf){ .len = rec->len, .data = (char *)(rec + 1) }));
+      sent += rec->len;
+      break;
+    case FNET_CAPTURE_CLOSE:
+      // Whoever closed, the responses are waited for first
+      session->closing = 1;
+      session_settle(session);
+      break;
+  }
+}
+
+void step(struct fnet_ev *ev) {
+  double   t   = now() - start;
+  uint64_t due = (uint64_t)(t * speed * 1e9);
+  double   wait;
+  size_t   i;
+
+  while((cursor < nrecs) && ((speed <= 0) || ((recs[cursor]->ts - t0) <= due))) {
+    if (speed > 0) {
+      wait = t - ((recs[cursor]->ts - t0) / (speed * 1e9));
+      if (wait > lagmax) lagmax = wait;
+    }
+    apply(cursor++);
+  }
+
+  if (cursor < nrecs) {
+    wait = ((recs[cursor]->ts - t0) / (speed * 1e9)) - t;
+    fnet_timer((int64_t)(wait * 1e3), step, NULL);
+    return;
+  }
+
+  // Captures cut off by their size limit miss closes
+  for ( i = 0 ; i < nsessions ; i++ ) {
+    sessions[i].closing = 1;
+    if (sessions[i].conn) session_settle(&(sessions[i]));
+  }
+  if (!nopen) {
+    finish();
+    return;
+  }
+  fnet_timer((int64_t)(timeout * 1e3), onTimeout, NULL);
+}
+
+int load(const char *filename) {
+  struct fnet_capture_header header;
+  struct fnet_capture_rec    *rec;
+  struct session             *session;
+  size_t   *last;
+  size_t   nmarks, i, j, off;
+  char     *data;
+  FILE     *fp;
+
+  fp = fopen(filename, "rb");
+  if (!fp) {
+    perror(filename);
+    return -1;
+  }
+
+  if (
+    (fread(&header, sizeof(header), 1, fp) != 1) ||
+    memcmp(header.magic, FNET_CAPTURE_MAGIC, sizeof(header.magic)) ||
+    (header.recsize != sizeof(struct fnet_capture_rec))
+  ) {
+    fprintf(stderr, "%s: not an fnet capture\n", filename);
+    fclose(fp);
+    return -1;
+  }
+  if (header.dropped) {
+    fprintf(stderr, "%s: %" PRIu64 " records didn't fit in the capture\n", filename, header.dropped);
+  }
+
+  data = malloc(header.length + 1);
+  if (!data || (fread(data, 1, header.length, fp) != header.length)) {
+    fprintf(stderr, "%s: truncated capture\n", filename);
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+
+  // Index the records, the capture is already in time order
+  for ( off = 0 ; (off + sizeof(struct fnet_capture_rec)) <= header.length ; ) {
+    rec = (struct fnet_capture_rec *)(data + off);
+    off += sizeof(struct fnet_capture_rec) + ((rec->len + (size_t)7) & ~((size_t)7));
+    if (off > header.length) break;
+    if (rec->type == FNET_CAPTURE_ACCEPT) nsessions++;
+    nrecs++;
+  }
+  recs     = calloc(nrecs + 1, sizeof(*recs));
+  expect   = calloc(nrecs + 1, sizeof(*expect));
+  sessions = calloc(nsessions + 1, sizeof(*sessions));
+  last     = calloc(nsessions + 1, sizeof(*last));
+  for ( lookupmask = 1 ; lookupmask < (nsessions * 2) ; lookupmask <<= 1 );
+  lookup    = calloc(lookupmask, sizeof(*lookup));
+  lookupmask--;
+  if (!recs || !expect || !sessions || !last || !lookup) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+
+  for ( off = 0, i = 0, nsessions = 0 ; i < nrecs ; i++ ) {
+    recs[i] = rec = (struct fnet_capture_rec *)(data + off);
+    off += sizeof(struct fnet_capture_rec) + ((rec->len + (size_t)7) & ~((size_t)7));
+    if (rec->type == FNET_CAPTURE_ACCEPT) {
+      sessions[nsessions].id = rec->conn;
+      for ( j = rec->conn & lookupmask ; lookup[j] ; j = (j + 1) & lookupmask );
+      lookup[j] = ++nsessions;
+      continue;
+    }
+    session = session_find(rec->conn);
+    if (!session) continue;
+
+    // Whatever the server wrote until the next request answers the last one
+    if (rec->type == FNET_CAPTURE_RECV) {
+      last[session - sessions] = i + 1;
+      session->nmarks++;
+    } else if ((rec->type == FNET_CAPTURE_SEND) && last[session - sessions]) {
+      expect[last[session - sessions] - 1] += rec->len;
+    }
+  }
+  free(last);
+
+  for ( i = 0, nmarks = 0 ; i < nsessions ; i++ ) {
+    sessions[i].marks  = calloc(sessions[i].nmarks + 1, sizeof(struct mark));
+    if (!sessions[i].marks) {
+      fprintf(stderr, "Out of memory\n");
+      return -1;
+    }
+    nmarks += sessions[i].nmarks;
+    sessions[i].nmarks = 0;
+  }
+  latencies = calloc(nmarks + 1, sizeof(double));
+  if (!latencies) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+
+  if (nrecs) t0 = recs[0]->ts;
+  return 0;
+}
+
+int main(int argc, const char *argv[]) {
+  const char *filename = NULL;
+  int i;
+
+  for( i = 1 ; i < argc ; i++ ) {
+    if (!strcmp("--host", argv[i]) && ((i + 1) < argc)) { host = argv[++i]; continue; }
+    if (!strcmp("--port", argv[i]) && ((i + 1) < argc)) { port = atoi(argv[++i]); continue; }
+    if (!strcmp("--speed", argv[i]) && ((i + 1) < argc)) { speed = atof(argv[++i]); continue; }
+    if (!strcmp("--timeout", argv[i]) && ((i + 1) < argc)) { timeout = atof(argv[++i]); continue; }
+    if ((argv[i][0] != '-') && !filename) { filename = argv[i]; continue; }
+    filename = NULL;
+    break;
+  }
+  if (!filename) {
+    fprintf(stderr, "Usage: %s [--host h] [--port n] [--speed x, 0 = no delays] [--timeout s] <capture file>\n", argv[0]);
+    return 1;
+  }
+
+  if (load(filename)) return 1;
+  if (!nrecs) {
+    fprintf(stderr, "%s: empty capture\n", filename);
+    return 1;
+  }
+
+  start = now();
+  fnet_timer(0, step, NULL);
+  fnet_main();
+  return 0;
+}
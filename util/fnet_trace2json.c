@@ -0,0 +1,112 @@
+// Converts a dump made by fnet_trace_dump into Chrome trace JSON
+// Load the output in chrome://tracing or https://ui.perfetto.dev
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fnet.h"
+
+#define FNET_TRACE_FORMAT_ONLY
+#include "fnet_trace.h"
+
+const char *event_name(int32_t type) {
+  switch(type) {
+    case FNET_EVENT_LISTEN  : return "onListen";
+    case FNET_EVENT_CONNECT : return "onConnect";
+    case FNET_EVENT_DATA    : return "onData";
+    case FNET_EVENT_TICK    : return "onTick";
+    case FNET_EVENT_CLOSE   : return "onClose";
+    case FNET_EVENT_SHED    : return "onShed";
+    case FNET_EVENT_RESUME  : return "onShed (resume)";
+    case FNET_EVENT_DRAIN   : return "onDrain";
+    case FNET_EVENT_TIMER   : return "timer";
+    case FNET_EVENT_END     : return "onEnd";
+    case FNET_EVENT_HANDOVER: return "onHandover";
+    default                 : return "callback";
+  }
+}
+
+const char *instant_name(uint32_t type) {
+  switch(type) {
+    case FNET_TRACE_RECV        : return "recv";
+    case FNET_TRACE_SEND        : return "send";
+    case FNET_TRACE_SEND_PARTIAL: return "send partial";
+    case FNET_TRACE_SEND_EAGAIN : return "send EAGAIN";
+    case FNET_TRACE_ACCEPT      : return "accept";
+    case FNET_TRACE_CLOSE       : return "close";
+    case FNET_TRACE_SHED        : return "shed";
+    default                     : return "unknown";
+  }
+}
+
+int main(int argc, const char *argv[]) {
+  struct fnet_trace_header header;
+  struct fnet_trace_rec    rec;
+  FILE     *fp;
+  uint64_t i;
+  uint64_t t0    = 0;
+  int      first = 1;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+    return 1;
+  }
+
+  fp = fopen(argv[1], "rb");
+  if (!fp) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  if (
+    (fread(&header, sizeof(header), 1, fp) != 1) ||
+    memcmp(header.magic, FNET_TRACE_MAGIC, sizeof(header.magic)) ||
+    (header.recsize != sizeof(struct fnet_trace_rec))
+  ) {
+    fprintf(stderr, "%s: not an fnet trace\n", argv[1]);
+    fclose(fp);
+    return 1;
+  }
+
+  printf("{\"otherData\":{\"dropped\":%" PRIu64 "},\"traceEvents\":[\n", header.dropped);
+
+  for ( i = 0 ; i < header.count ; i++ ) {
+    if (fread(&rec, sizeof(rec), 1, fp) != 1) break;
+    if (!i) t0 = rec.ts;
+
+    printf(first ? "" : ",\n");
+    first = 0;
+
+    // Microseconds with fractions, as chrome expects
+    printf("{\"pid\":1,\"tid\":1,\"ts\":%" PRIu64 ".%03" PRIu64 ",", (rec.ts - t0) / 1000, (rec.ts - t0) % 1000);
+
+    switch(rec.type) {
+      case FNET_TRACE_WAIT:
+        printf("\"ph\":\"B\",\"name\":\"fpoll_wait\",\"args\":{\"timeout\":%d}}", rec.arg);
+        break;
+      case FNET_TRACE_WAKEUP:
+        printf("\"ph\":\"E\",\"name\":\"fpoll_wait\",\"args\":{\"events\":%d}}", rec.arg);
+        break;
+      case FNET_TRACE_CB_ENTER:
+        printf("\"ph\":\"B\",\"name\":\"%s\",\"args\":{\"conn\":%" PRIu64 "}}", event_name(rec.arg), rec.conn);
+        break;
+      case FNET_TRACE_CB_EXIT:
+        printf("\"ph\":\"E\",\"name\":\"%s\"}", event_name(rec.arg));
+        break;
+      case FNET_TRACE_TICK_ENTER:
+        printf("\"ph\":\"B\",\"name\":\"fnet_tick\",\"args\":{\"process\":%d}}", rec.arg);
+        break;
+      case FNET_TRACE_TICK_EXIT:
+        printf("\"ph\":\"E\",\"name\":\"fnet_tick\",\"args\":{\"walked\":%d}}", rec.arg);
+        break;
+      default:
+        printf("\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"args\":{\"conn\":%" PRIu64 ",\"arg\":%d}}", instant_name(rec.type), rec.conn, rec.arg);
+        break;
+    }
+  }
+
+  printf("\n]}\n");
+  fclose(fp);
+  return 0;
+}